@@ -0,0 +1,137 @@
+/*
+ * bench_scan: microbenchmark for the lexer's scanner backends.
+ *
+ *   gcc -O2 -Wall -Wextra bench_scan.c -o bench_scan && ./bench_scan [args] [iterations]
+ *
+ * Builds one long command line of `args` words (default 500) with a few
+ * quotes and separators mixed in, then times finding every special byte
+ * with scan_special_scalar/sse2/avx2 and lexing the whole line with
+ * lex_line on top of each of them. The byte-at-a-time loop is the
+ * reference the vector backends are checked against.
+ */
+#define SIMPLE_SHELL_NO_MAIN
+#include "shell_file_input.c"
+
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    const char *(*scan)(const char *p);
+} ScanBackend;
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char *make_line(int num_args) {
+    size_t size = (size_t)num_args * 32 + 64;
+    char *line = malloc(size);
+    size_t len = 0;
+
+    if (line == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    len += snprintf(line, size, "/usr/bin/generated_command");
+    for (int i = 0; i < num_args; i++) {
+        if (i % 97 == 96) {
+            len += snprintf(line + len, size - len, " ; echo");
+        }
+
+        else if (i % 31 == 30) {
+            len += snprintf(line + len, size - len, " \"quoted argument %d\"", i);
+        }
+
+        else {
+            len += snprintf(line + len, size - len, " --generated-option-%d=value", i);
+        }
+    }
+
+    return line;
+}
+
+/* count_specials: walk every special byte of line, the way the lexer does. */
+size_t count_specials(const char *(*scan)(const char *p), const char *line) {
+    size_t count = 0;
+    const char *p = line;
+
+    while (*(p = scan(p)) != '\0') {
+        count++;
+        p++;
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    int num_args = argc > 1 ? atoi(argv[1]) : 500;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+    char *line = make_line(num_args);
+    size_t len = strlen(line);
+    char *copy = malloc(len + 1);
+    Token *tokens = malloc((size_t)num_args * 4 * sizeof(Token));
+    ScanBackend backends[] = {
+        {"scalar", scan_special_scalar},
+#ifdef __SSE2__
+        {"sse2", scan_special_sse2},
+        {"avx2", scan_special_avx2},
+#endif
+    };
+    size_t expected = count_specials(scan_special_scalar, line);
+
+    if (copy == NULL || tokens == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("line: %zu bytes, %d args, %zu special bytes, %d iterations\n", len, num_args, expected, iterations);
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        volatile size_t sink = 0;
+        double start;
+        double scan_time;
+        double lex_time;
+        int num_tokens = 0;
+
+#ifdef __SSE2__
+        if (backends[b].scan == scan_special_avx2 && !__builtin_cpu_supports("avx2")) {
+            printf("%-7s skipped, CPU has no AVX2\n", backends[b].name);
+            continue;
+        }
+#endif
+
+        if (count_specials(backends[b].scan, line) != expected) {
+            fprintf(stderr, "%s: wrong result\n", backends[b].name);
+            return EXIT_FAILURE;
+        }
+
+        start = now();
+        for (int i = 0; i < iterations; i++) {
+            sink += count_specials(backends[b].scan, line);
+        }
+        scan_time = now() - start;
+
+        scan_special = backends[b].scan;
+        start = now();
+        for (int i = 0; i < iterations; i++) {
+            memcpy(copy, line, len + 1);
+            num_tokens = lex_line(copy, tokens, num_args * 4);
+            sink += num_tokens;
+        }
+        lex_time = now() - start;
+
+        printf("%-7s scan %8.1f ns/line %6.2f GB/s   lex_line %8.1f ns/line (%d tokens)\n",
+               backends[b].name,
+               scan_time / iterations * 1e9, len * (double)iterations / scan_time / 1e9,
+               lex_time / iterations * 1e9, num_tokens);
+    }
+
+    free(tokens);
+    free(copy);
+    free(line);
+    return 0;
+}
@@ -7,6 +7,8 @@
 
 #define MAX_INPUT_LENGTH 1024
 
+extern char **environ;
+
 /*
 *command_exists: function that check for if path is present 
 *main: where the main function is executed
@@ -65,10 +67,8 @@ int main(void){
         }
 
         if (strcmp(input, "env") == 0){
-            char *env_var = *environ;
-            while (env_var != NULL){
-                printf("%s\n", env_var);
-                env_var = *(environ++);
+            for (char **env_var = environ; *env_var != NULL; env_var++){
+                printf("%s\n", *env_var);
             }
             continue;
         }
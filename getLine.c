@@ -24,41 +24,49 @@ char *custom_getline(void){
     
     char *line = NULL;
     size_t line_length = 0;
+    size_t line_capacity = 0;
     
     while (1){
         if (buffer_position >= buffer_size){
             ssize_t bytes_read = read(STDIN_FILENO, buffer, BUFFER_SIZE);
             if (bytes_read <= 0){
-                return NULL;
+                if (line == NULL){
+                    return NULL;
+                }
+                break;
             }
             buffer_size = (size_t)bytes_read;
             buffer_position = 0;
         }
         
-        if (buffer[buffer_position] == '\n'){
-            buffer[buffer_position] = '\0';
-            buffer_position++;
-            break;
-        }
+        /* Copy up to the newline in one go instead of byte by byte. */
+        char *newline = memchr(buffer + buffer_position, '\n', buffer_size - buffer_position);
+        size_t chunk = (newline != NULL ? (size_t)(newline - buffer) : buffer_size) - buffer_position;
         
-        if (line_length == 0){
-            line = malloc(1);
-            if (line == NULL){
-                perror("malloc");
-                exit(EXIT_FAILURE);
+        if (line_length + chunk + 1 > line_capacity){
+            size_t new_capacity = line_capacity ? line_capacity * 2 : 128;
+            while (new_capacity < line_length + chunk + 1){
+                new_capacity *= 2;
             }
-        }
-        else{
-            char *new_line = realloc(line, line_length + 2);
+            
+            char *new_line = realloc(line, new_capacity);
             if (new_line == NULL){
                 perror("realloc");
                 free(line);
                 exit(EXIT_FAILURE);
             }
             line = new_line;
+            line_capacity = new_capacity;
         }
         
-        line[line_length++] = buffer[buffer_position++];
+        memcpy(line + line_length, buffer + buffer_position, chunk);
+        line_length += chunk;
+        buffer_position += chunk;
+        
+        if (newline != NULL){
+            buffer_position++;
+            break;
+        }
     }
     
     line[line_length] = '\0';
@@ -0,0 +1,32 @@
+#ifndef LOADABLE_BUILTIN_H
+#define LOADABLE_BUILTIN_H
+
+/*
+ * ABI for builtins loaded with `enable -f lib.so name`.
+ *
+ * The library exports one LoadableBuiltin per builtin, named
+ * <name>_builtin (e.g. `LoadableBuiltin jsonget_builtin = {...}`), with
+ * abi_version set to LOADABLE_BUILTIN_ABI.
+ *
+ * run is called in the shell process with the argument vector (argv[0] is
+ * the builtin's name, argv[argc] is NULL), the environment, and the fds
+ * the builtin should use for input, output and errors; these follow any
+ * redirection or pipe the command runs under, so write to them rather
+ * than to stdio. The return value is the exit status. run must not exit()
+ * or keep pointers into argv/envp after returning.
+ *
+ * init and cleanup are optional: init runs once after loading (non-zero
+ * refuses the load), cleanup before `enable -d` unloads the library.
+ */
+
+#define LOADABLE_BUILTIN_ABI 1
+
+typedef struct {
+    unsigned int abi_version;
+    const char *name;
+    int (*run)(int argc, char **argv, char **envp, int in_fd, int out_fd, int err_fd);
+    int (*init)(void);
+    void (*cleanup)(void);
+} LoadableBuiltin;
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,23 +7,138 @@
 #include <sys/wait.h>
 #include <limits.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <dlfcn.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-#define MAX_INPUT_LENGTH 1024
+#include "loadable_builtin.h"
+
+#define TOKEN_WORD 0
+#define TOKEN_SEMI 1
+#define TOKEN_AMP 2
+#define TOKEN_PIPE 3
+#define TOKEN_AND 4
+#define TOKEN_OR 5
+#define TOKEN_LPAREN 6
+#define TOKEN_RPAREN 7
+#define TOKEN_END -1
+#define NODE_SIMPLE 0
+#define NODE_PIPELINE 1
+#define NODE_AND_OR 2
+#define NODE_LIST 3
+#define NODE_GROUP 4
+#define NODE_SUBSHELL 5
+#define NODE_ASYNC 1
+#define NODE_IF_SUCCESS 2
+#define NODE_IF_FAILURE 4
+#define SPAWN_MAX_ACTIONS 16
+#define SPAWN_STACK_SIZE (64 * 1024)
+#define ZYGOTE_MAX_FDS (SPAWN_MAX_ACTIONS + 4)
+#define ZYGOTE_ENV_UNCHANGED UINT32_MAX
+#define COMMAND_HASH_SIZE 256
+#define BUILTIN_TABLE_BITS 7
+#define BUILTIN_TABLE_SIZE (1 << BUILTIN_TABLE_BITS)
+#define BUILTIN_HASH_SEED 0x9e3779b3u
+#define BUILTIN_OUTPUT 1
+#define BUILTIN_STATE 2
+#define INDEX_MAGIC "SSHIDX\0\1"
+#define INDEX_VERSION 1
+#define INDEX_MAX_DIRS 128
+#define INDEX_UNKNOWN 0
+#define INDEX_READY 1
+#define INDEX_DISABLED 2
+#define MAX_PIPELINE 64
+#define PIPE_SPLICE_CHUNK (64 * 1024)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define READER_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define CACHE_MAGIC "SSHSCR\0\1"
+#define CACHE_VERSION 3
+#define CACHE_RELEX -2
+#define CACHE_HITS 0
+#define CACHE_MISSES 1
+#define CACHE_STALE 2
+#define CACHE_NUM_COUNTERS 3
+#define ARITH_CACHE_SIZE 256
+#define ARITH_MAX_DEPTH 32
+#define SUBST_READ_SIZE 4096
+
+extern char **environ;
 
 /*
+*spawn_process: launch a command with posix_spawn, a CLONE_VFORK clone, fork or
+*   the pre-forked zygote helper, selected at runtime through SIMPLE_SHELL_SPAWN
+*hash_lookup: cached PATH lookup used by execute_command; `hash` lists,
+*   pre-warms (-p) and clears (-r) the cache
+*index_lookup: shared, mmap'd command index under $SIMPLE_SHELL_INDEX, rebuilt
+*   when a PATH directory changes (inotify with SIMPLE_SHELL_INDEX_WATCH=1)
+*execute_pipeline: run `a | b | c` with pipe2(O_CLOEXEC) and all stages
+*   concurrently; the last stage gives the status, PIPESTATUS holds all of them
+*execute_builtin: dispatch to a builtin through the hashed builtin registry
+*start_job: run a command ending in '&' in the background; `jobs` lists the
+*   job table, `wait [-n] [%id|pid]` waits; SIGCHLD wakes a self-pipe
+*builtin_parallel: `parallel [-j N] [-k] cmd {} ::: inputs` runs a bounded
+*   worker pool with per-task buffered output
+*builtin_echo, builtin_printf, builtin_pwd, builtin_test: echo, printf, pwd,
+*   true, false and test/[ run in-process; `command` and `builtin` pick the
+*   builtin or the PATH version explicitly
+*builtin_enable: `enable -f lib.so name` loads builtins implementing the ABI in
+*   loadable_builtin.h; `enable -d name` unloads them
 * the main function now checks the number of command-line arguments
 *lines starting with # are skipped and treated as comments
 *'echo $?' will print the exit status of the previous command
 *'echo $$' will print the process ID of the shell
 *print_aliases: function to print specific Aliases
-*list_aliases: function to list Aliases
-*struct: Data struct to store Alias
-*define_alias: function to define Alias
+*list_aliases: function to list Aliases, sorted by name
+*struct: Data struct to store Alias, in an open-addressing hash table
+*define_alias: function to define Alias; its value is lexed once up front
+*expand_aliases: replace aliases in command position with their cached
+*   tokens, never re-expanding an alias inside itself
 *&& and || in your shell to execute commands
 *   conditionally based on the success or failure of previous commands. 
 *execute_command: function to execute a single command
-*parse_command: function that allows for parsing
-*custom_getline: function that allows to get line
+*scan_special: SSE2/AVX2/scalar scanner the lexer uses to skip plain bytes,
+*   chosen by CPU or SIMPLE_SHELL_SCAN
+*lex_line: quote-aware lexer; tokens are slices of the line, dequoted in place
+*   by materialize_word only when the command runs
+*parse_line: recursive-descent parser building an index-linked AST of lists,
+*   && / || chains, pipelines, { } groups and ( ) subshells
+*execute_line: lex, parse and evaluate a line with execute_node; its
+*   temporaries come from line_arena and are released when it returns
+*var_set: shell-owned variables in a hash table with export flags; envp for
+*   commands is rebuilt by var_environ only after an exported one changed
+*export, unset, env: builtins over the variable store; NAME=value words
+*   before a command go to its environment only, alone they set variables
+*arith_eval: $(( )) and let; 64-bit precedence-climbing evaluator with
+*   constant folding and a cache of compiled expressions
+*command_substitute: $( ) and ` `, output-only builtins in the shell, the
+*   rest in a forked shell read through a pipe into a doubling buffer
+*expand_word: one-pass $?, $$, $!, $#, positional and $VAR / ${VAR}
+*   expansion of a word, dequoting it on the way into line_arena
+*reader_getline: block-buffered, memchr-scanned line reader, one per fd,
+*   returning zero-copy views; used for the terminal, scripts and `source`
+*reader_open: scripts that are regular files are mmap'd and lexed in place
+*run_file: run a script from its parsed image under $SIMPLE_SHELL_CACHE when
+*   one is valid for the file's inode, size and mtime; --cache-stats reports
+*pwd_get: cached logical cwd, checked with one stat; cd -L/-P and the
+*   prompt use it, and getcwd only runs when it has gone stale
+*main: [-is] [-c string | file]; prompt only when interactive,
+*   fully buffered stdout otherwise
 *command_exists: function that check for if path is present 
 *main: where the main function is executed
 *printf: display the prompt
@@ -30,468 +146,6678 @@
 *Return: string output to the screen
 */
 
-void parse_command(char *input, char **command, char **args){
-    int i = 0;
-    while (input[i] != '\0' && input[i] != ' ' && input[i] != '\t' && input[i] != '\n'){
-        i++;
-    }
+/*
+ * Arena: bump allocator for everything that only lives as long as one
+ * command line (tokens, argv arrays, expansion results). Blocks are chained
+ * and kept across lines, so releasing back to a mark is O(1) and the steady
+ * state does no malloc at all. Marks nest, which lets a line run another
+ * line (parallel tasks, later substitutions) and release only its own part.
+ * SIMPLE_SHELL_ARENA_DEBUG=1 reports the peak size of each line on stderr.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
 
-    *command = strndup(input, i);
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t total;
+    size_t peak;
+} Arena;
 
-    while (input[i] == ' ' || input[i] == '\t'){
-        i++;
-    }
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+    size_t total;
+} ArenaMark;
 
-    int arg_count = 0;
-    while (input[i] != '\0' && input[i] != '\n'){
-        int arg_start = i;
-        while (input[i] != '\0' && input[i] != ' ' && input[i] != '\t' && input[i] != '\n'){
-            i++;
+Arena line_arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->current;
+
+    size = (size + 15) & ~(size_t)15;
+
+    /* Move on to the next kept block that fits, or chain a new one. */
+    while (block == NULL || block->size - block->used < size) {
+        ArenaBlock *next = block != NULL ? block->next : arena->first;
+
+        while (next != NULL && next->size < size) {
+            next = next->next;
         }
-        args[arg_count++] = strndup(input + arg_start, i - arg_start);
 
-        while (input[i] == ' ' || input[i] == '\t'){
-            i++;
+        if (next == NULL) {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+            next = malloc(sizeof(ArenaBlock) + block_size);
+            if (next == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            next->size = block_size;
+            next->next = NULL;
+
+            if (block != NULL) {
+                next->next = block->next;
+                block->next = next;
+            }
+
+            else {
+                next->next = arena->first;
+                arena->first = next;
+            }
+        }
+
+        if (block != NULL) {
+            arena->total += block->size - block->used;
         }
+        next->used = 0;
+        block = next;
+    }
+
+    arena->current = block;
+    block->used += size;
+    arena->total += size;
+    if (arena->total > arena->peak) {
+        arena->peak = arena->total;
     }
 
-    args[arg_count] = NULL;
+    return block->data + block->used - size;
 }
 
-int execute_command(char *command, char **args) {
-    pid_t pid = fork();
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+    char *copy = arena_alloc(arena, n + 1);
 
-    if (pid == -1) {
-        perror("fork");
-        exit(EXIT_FAILURE);
-    } 
-    
-    else if (pid == 0) {
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
 
-        if (execvp(command, args) == -1) {
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        }
-    } 
-    
-    else {
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            exit(EXIT_FAILURE);
-        }
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark = {arena->current, arena->current != NULL ? arena->current->used : 0, arena->total};
 
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
-        }
+    return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+    arena->current = mark.block;
+    if (mark.block != NULL) {
+        mark.block->used = mark.used;
     }
+    arena->total = mark.total;
+}
 
-    return -1;
+/*
+ * Scanner: find the next byte the lexer has to look at, i.e. whitespace,
+ * a quote, backquote or backslash, one of ; & | ( ) # $ or the terminating NUL. Long
+ * unquoted runs are skipped 16 (SSE2) or 32 (AVX2) bytes at a time. The
+ * vector loops use aligned loads, so they may read past the NUL but never
+ * into the next page. SIMPLE_SHELL_SCAN=scalar|sse2|avx2 forces a backend.
+ */
+static const unsigned char scan_special_table[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\''] = 1, ['"'] = 1,
+    ['\\'] = 1, [';'] = 1, ['&'] = 1, ['|'] = 1, ['('] = 1, [')'] = 1, ['#'] = 1, ['$'] = 1,
+    ['`'] = 1,
+};
+
+const char *scan_special_scalar(const char *p) {
+    while (!scan_special_table[(unsigned char)*p]) {
+        p++;
+    }
+
+    return p;
 }
 
-typedef struct {
-    char *name;
-    char *value;
-} Alias;
+#ifdef __SSE2__
+static inline unsigned scan_mask_sse2(__m128i v) {
+    __m128i m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
 
-Alias aliases[MAX_INPUT_LENGTH];
-int num_aliases = 0;
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('`')));
 
-void define_alias(char *name, char *value) {
-    for (int i = 0; i < num_aliases; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            free(aliases[i].value);
-            aliases[i].value = strdup(value);
-            return;
-        }
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+const char *scan_special_sse2(const char *p) {
+    unsigned offset = (uintptr_t)p & 15;
+    const char *block = p - offset;
+    unsigned mask = scan_mask_sse2(_mm_load_si128((const __m128i *)block)) >> offset << offset;
+
+    while (mask == 0) {
+        block += 16;
+        mask = scan_mask_sse2(_mm_load_si128((const __m128i *)block));
     }
 
-    aliases[num_aliases].name = strdup(name);
-    aliases[num_aliases].value = strdup(value);
-    num_aliases++;
+    return block + __builtin_ctz(mask);
 }
 
-void list_aliases() {
-    for (int i = 0; i < num_aliases; i++) {
-        printf("%s='%s'\n", aliases[i].name, aliases[i].value);
+/*
+ * AVX2 has a byte shuffle, so classify with two nibble lookups instead of
+ * twelve compares: each high nibble that holds a special byte gets a bit,
+ * and the low-nibble table sets that bit for the low nibbles in its group.
+ */
+__attribute__((target("avx2")))
+static inline unsigned scan_mask_avx2(__m256i v) {
+    const __m256i low_table = _mm256_setr_epi8(
+        0x23, 0, 0x02, 0x02, 0x02, 0, 0x02, 0x02, 0x02, 0x03, 0x01, 0x04, 0x18, 0, 0, 0,
+        0x23, 0, 0x02, 0x02, 0x02, 0, 0x02, 0x02, 0x02, 0x03, 0x01, 0x04, 0x18, 0, 0, 0);
+    const __m256i high_table = _mm256_setr_epi8(
+        0x01, 0, 0x02, 0x04, 0, 0x08, 0x20, 0x10, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0, 0x02, 0x04, 0, 0x08, 0x20, 0x10, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+    __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i hit = _mm256_and_si256(low, high);
+
+    return ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+const char *scan_special_avx2(const char *p) {
+    unsigned offset = (uintptr_t)p & 31;
+    const char *block = p - offset;
+    unsigned mask = scan_mask_avx2(_mm256_load_si256((const __m256i *)block)) >> offset << offset;
+
+    while (mask == 0) {
+        block += 32;
+        mask = scan_mask_avx2(_mm256_load_si256((const __m256i *)block));
     }
+
+    return block + __builtin_ctz(mask);
 }
+#endif
 
-void print_aliases(char **args) {
-    for (int i = 1; args[i] != NULL; i++) {
-        for (int j = 0; j < num_aliases; j++) {
-            if (strcmp(aliases[j].name, args[i]) == 0) {
-                printf("%s='%s'\n", aliases[j].name, aliases[j].value);
+const char *scan_special_init(const char *p);
+
+const char *(*scan_special)(const char *p) = scan_special_init;
+
+/* scan_special_init: pick a backend on first use, then forward to it. */
+const char *scan_special_init(const char *p) {
+    char *name = getenv("SIMPLE_SHELL_SCAN");
+
+    scan_special = scan_special_scalar;
+#ifdef __SSE2__
+    if (name == NULL || strcmp(name, "scalar") != 0) {
+        scan_special = scan_special_sse2;
+    }
+
+    __builtin_cpu_init();
+    if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        scan_special = scan_special_avx2;
+    }
+#else
+    (void)name;
+#endif
+
+    return scan_special(p);
+}
+
+/*
+ * Lexer: one pass over the line that records words and operators as slices
+ * of the line itself. Quotes and backslashes are only noted (Token.quoted);
+ * the word is turned into a C string in place by materialize_word() when a
+ * command is about to run, which is safe because dequoting never makes a
+ * word longer and every token has been found by then. Words with a '$'
+ * outside single quotes are flagged WORD_EXPAND and copied out by
+ * expand_word() instead, since expansion can make them longer.
+ */
+#define WORD_QUOTED 1
+#define WORD_EXPAND 2
+
+typedef struct {
+    int type;
+    char *start;
+    int length;
+    int quoted;
+} Token;
+
+int is_operator_char(char c) {
+    return c == ';' || c == '&' || c == '|' || c == '(' || c == ')';
+}
+
+/* Set while the script cache parses ahead, so errors are reported when the line runs instead. */
+int syntax_quiet = 0;
+
+char *skip_subst(char *p);
+
+/* skip_arith: p is just inside "$(("; return the end of the matching "))", or NULL. */
+char *skip_arith(char *p) {
+    int depth = 0;
+
+    for (; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        }
+
+        else if (*p == ')' && depth == 0 && p[1] == ')') {
+            return p + 2;
+        }
+
+        else if (*p == ')') {
+            depth--;
+        }
+    }
+
+    return NULL;
+}
+
+/* skip_subst: p is just inside "$("; return the end of the matching ")", or NULL. Quotes nest. */
+char *skip_subst(char *p) {
+    int depth = 0;
+
+    for (; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+
+        else if (*p == '\'' || *p == '"') {
+            char quote = *p;
+
+            for (p++; *p != quote; p++) {
+                if (*p == '\0') {
+                    return NULL;
+                }
+                if (quote == '"' && *p == '\\' && p[1] != '\0') {
+                    p++;
+                }
             }
         }
+
+        else if (*p == '(') {
+            depth++;
+        }
+
+        else if (*p == ')' && depth-- == 0) {
+            return p + 1;
+        }
     }
+
+    return NULL;
 }
 
-void execute_commands_from_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+/* skip_expansion: p is at "$((", "$(" or "`"; return the end of what it opens, or NULL if unterminated. */
+char *skip_expansion(char *p) {
+    if (*p == '`') {
+        for (p++; *p != '`'; p++) {
+            if (*p == '\0') {
+                return NULL;
+            }
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+        }
+        return p + 1;
     }
 
-    char line[MAX_INPUT_LENGTH];
+    return p[2] == '(' ? skip_arith(p + 3) : skip_subst(p + 2);
+}
 
-    while (fgets(line, sizeof(line), file) != NULL) {
-        line[strcspn(line, "\n")] = '\0';
+/*
+ * lex_line: split line into tokens, stopping at an unquoted '#' that starts
+ * a word. Returns the token count, or -1 after reporting a syntax error.
+ */
+int lex_line(char *line, Token *tokens, int max_tokens) {
+    int num_tokens = 0;
+    char *p = line;
 
-        if (strlen(line) == 0 || line[0] == '#') {
-            continue;
+    while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') {
+            p++;
         }
 
-        char *pos = strstr(line, "$?");
-        if (pos != NULL) {
-            char exit_status[16];
-            snprintf(exit_status, sizeof(exit_status), "%d", errno);
-            strcpy(pos, exit_status);
+        if (*p == '\0' || *p == '#') {
+            break;
         }
 
-        pos = strstr(line, "$$");
-        if (pos != NULL) {
-            char pid_str[16];
-            snprintf(pid_str, sizeof(pid_str), "%d", getpid());
-            strcpy(pos, pid_str);
+        if (num_tokens == max_tokens) {
+            if (!syntax_quiet) {
+                fprintf(stderr, "syntax error: too many words\n");
+            }
+            return -1;
         }
 
-        char *commands[MAX_INPUT_LENGTH];
-        char *token = strtok(line, ";");
+        Token *token = &tokens[num_tokens++];
+        token->start = p;
+        token->quoted = 0;
+
+        if (is_operator_char(*p)) {
+            if ((p[0] == '&' || p[0] == '|') && p[1] == p[0]) {
+                token->type = p[0] == '&' ? TOKEN_AND : TOKEN_OR;
+                p += 2;
+            }
+
+            else {
+                switch (*p) {
+                    case ';': token->type = TOKEN_SEMI; break;
+                    case '&': token->type = TOKEN_AMP; break;
+                    case '|': token->type = TOKEN_PIPE; break;
+                    case '(': token->type = TOKEN_LPAREN; break;
+                    default: token->type = TOKEN_RPAREN; break;
+                }
+                p++;
+            }
 
-        int num_commands = 0;
-        while (token != NULL) {
-            commands[num_commands++] = strdup(token);
-            token = strtok(NULL, ";");
+            token->length = p - token->start;
+            continue;
         }
 
-        int status = 0;
+        token->type = TOKEN_WORD;
+        while (1) {
+            p = (char *)scan_special(p);
 
-        for (int i = 0; i < num_commands; i++) {
-            char *command;
-            char *args[MAX_INPUT_LENGTH];
+            if (*p == '\0' || *p == ' ' || *p == '\t' || *p == '\n' || is_operator_char(*p)) {
+                break;
+            }
 
-            parse_command(commands[i], &command, args);
+            else if (*p == '\\') {
+                token->quoted |= WORD_QUOTED;
+                p += p[1] != '\0' ? 2 : 1;
+            }
 
-            if (strcmp(command, "exit") == 0) {
-                int exit_status = 0;
-                if (args[1] != NULL) {
-                    exit_status = atoi(args[1]);
-                }
-                printf("Exiting simple_shell with status %d.\n", exit_status);
-                exit(exit_status);
-            } 
-            
-            else if (strcmp(command, "setenv") == 0) {
-                if (args[1] != NULL && args[2] != NULL) {
-                    if (setenv(args[1], args[2], 1) != 0) {
-                        fprintf(stderr, "Failed to set environment variable %s\n", args[1]);
-                    }
-                } else {
-                    fprintf(stderr, "Usage: setenv VARIABLE VALUE\n");
-                }
-            } 
-            
-            else if (strcmp(command, "unsetenv") == 0) {
-                if (args[1] != NULL) {
-                    if (unsetenv(args[1]) != 0) {
-                        fprintf(stderr, "Failed to unset environment variable %s\n", args[1]);
-                    }
-                } 
-                
-                else {
-                    fprintf(stderr, "Usage: unsetenv VARIABLE\n");
-                }
-            } 
-            
-            else if (strcmp(command, "cd") == 0) {
-                if (args[1] == NULL || strcmp(args[1], "~") == 0) {
-                    if (chdir(getenv("HOME")) != 0) {
-                        perror("chdir");
-                    }
-                } 
-                
-                else if (strcmp(args[1], "-") == 0) {
-                    char *prev_dir = getenv("OLDPWD");
-                    if (prev_dir != NULL && chdir(prev_dir) != 0) {
-                        perror("chdir");
-                    }
-                } 
-                
-                else {
-                    if (chdir(args[1]) != 0) {
-                        perror("chdir");
-                    }
+            else if (*p == '\'' || *p == '"') {
+                char quote = *p++;
+
+                token->quoted |= WORD_QUOTED;
+                if (quote == '\'') {
+                    p = strchrnul(p, quote);
                 }
 
-                if (setenv("PWD", getcwd(cwd, sizeof(cwd)), 1) != 0) {
-                    perror("setenv");
-                }
-            } 
-            
-            else if (strcmp(command, "alias") == 0) {
-                if (args[1] == NULL) {
-                    list_aliases();
-                } 
-                
-                else if (args[2] == NULL) {
-                    print_aliases(args);
-                } 
-                
                 else {
-                    int j = 1;
-                    while (args[j] != NULL) {
-                        char *name = args[j];
-                        char *value = strchr(name, '=');
-
-                        if (value == NULL) {
-                            fprintf(stderr, "Invalid alias syntax: %s\n", name);
-                            break;
+                    while (*(p = (char *)scan_special(p)) != '\0' && *p != quote) {
+                        if (*p == '`' || (p[0] == '$' && p[1] == '(')) {
+                            char *close = skip_expansion(p);
+
+                            token->quoted |= WORD_EXPAND;
+                            p = close != NULL ? close : p + strlen(p);
+                            continue;
+                        }
+
+                        if (*p == '$') {
+                            token->quoted |= WORD_EXPAND;
                         }
+                        p += *p == '\\' && p[1] != '\0' ? 2 : 1;
+                    }
+                }
 
-                        *value = '\0';
-                        value++; 
+                if (*p == '\0') {
+                    if (!syntax_quiet) {
+                        fprintf(stderr, "syntax error: unterminated %c\n", quote);
+                    }
+                    return -1;
+                }
+                p++;
+            }
 
-                        define_alias(name, value);
+            /* $(( )), $( ) and ` ` are one piece of the word, blanks and parentheses included. */
+            else if (*p == '`' || (p[0] == '$' && p[1] == '(')) {
+                const char *opening = *p == '`' ? "`" : p[2] == '(' ? "$((" : "$(";
 
-                        j++;
+                token->quoted |= WORD_EXPAND;
+                p = skip_expansion(p);
+                if (p == NULL) {
+                    if (!syntax_quiet) {
+                        fprintf(stderr, "syntax error: unterminated %s\n", opening);
                     }
+                    return -1;
                 }
-            } 
-            
+            }
+
             else {
-                if (status == 0) {
-                    if (strcmp(command, "&&") == 0) {
-                        status = execute_command(args[0], args + 1);
-                    } 
-                    
-                    else if (strcmp(command, "||") == 0) {
-                        status = execute_command(args[0], args + 1);
-                    } 
-                    
-                    else {
-                        status = execute_command(command, args);
-                    }
-                } 
-                
-                else {
-                    status = 0;
+                if (*p == '$') {
+                    token->quoted |= WORD_EXPAND;
                 }
+                p++;
+            }
+        }
+
+        token->length = p - token->start;
+    }
+
+    return num_tokens;
+}
+
+char *expand_word(Token *token);
+
+/* materialize_word: turn a word token into a NUL-terminated, dequoted (and expanded) string. */
+char *materialize_word(Token *token) {
+    char *in = token->start;
+    char *end = token->start + token->length;
+    char *out = token->start;
+
+    if (!token->quoted) {
+        *end = '\0';
+        return token->start;
+    }
+
+    if (token->quoted & WORD_EXPAND) {
+        return expand_word(token);
+    }
+
+    while (in < end) {
+        if (*in == '\\') {
+            in++;
+            if (in < end && *in != '\n') {
+                *out++ = *in;
             }
+            in++;
+        }
+
+        else if (*in == '\'') {
+            for (in++; *in != '\''; ) {
+                *out++ = *in++;
+            }
+            in++;
+        }
 
-            free(command);
-            for (int j = 0; args[j] != NULL; j++) {
-                free(args[j]);
+        else if (*in == '"') {
+            for (in++; *in != '"'; ) {
+                if (*in == '\\' && strchr("$`\"\\\n", in[1]) != NULL) {
+                    in++;
+                    if (*in == '\n') {
+                        in++;
+                        continue;
+                    }
+                }
+                *out++ = *in++;
             }
+            in++;
         }
 
-        for (int i = 0; i < num_commands; i++) {
-            free(commands[i]);
+        else {
+            *out++ = *in++;
         }
     }
 
-    for (int i = 0; i < num_aliases; i++) {
-        free(aliases[i].name);
-        free(aliases[i].value);
+    *out = '\0';
+    token->quoted = 0;
+    token->length = out - token->start;
+    return token->start;
+}
+
+/*
+ * build_argv: materialize the words of one simple command into a
+ * NULL-terminated argv. An unquoted word that expands to nothing, like
+ * $UNSET, is dropped; "$UNSET" stays as an empty argument.
+ */
+int build_argv(Token *tokens, int num_tokens, char **argv) {
+    int argc = 0;
+
+    for (int i = 0; i < num_tokens; i++) {
+        int droppable = tokens[i].quoted == WORD_EXPAND;
+
+        argv[argc] = materialize_word(&tokens[i]);
+        if (!droppable || *argv[argc] != '\0') {
+            argc++;
+        }
     }
+    argv[argc] = NULL;
 
-    printf("Exiting simple_shell.\n");
+    return argc;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc == 2) {
-        execute_commands_from_file(argv[1]);
-    } 
-    
-    else if (argc > 2) {
-        fprintf(stderr, "Usage: %s [filename]\n", argv[0]);
-        return EXIT_FAILURE;
-    } 
-    
-    else {
-        char input[MAX_INPUT_LENGTH];
-        char cwd[PATH_MAX];
+/* The text of a token range as typed, for job listings. */
+char *token_text(Token *tokens, int num_tokens) {
+    size_t len = 0;
 
-        while (1) {
-            if (getcwd(cwd, sizeof(cwd)) == NULL) {
-                perror("getcwd");
-                exit(EXIT_FAILURE);
-            }
+    for (int i = 0; i < num_tokens; i++) {
+        len += tokens[i].length + 1;
+    }
 
-            printf("simple_shell:%s$ ", cwd);
+    /* Joined with single spaces: alias expansion means tokens need not be adjacent in memory. */
+    char *text = arena_alloc(&line_arena, len);
+    char *p = text;
 
-            if (fgets(input, sizeof(input), stdin) == NULL) {
-                printf("\n");
-                break;
-            }
+    for (int i = 0; i < num_tokens; i++) {
+        memcpy(p, tokens[i].start, tokens[i].length);
+        p += tokens[i].length;
+        *p++ = ' ';
+    }
+    p[-1] = '\0';
 
+    return text;
+}
 
-        input[strcspn(input, "\n")] = '\0';
+/*
+ * Parser: recursive descent over the tokens of one line into a compact AST.
+ * Nodes live in one array (from line_arena) and refer to each other by
+ * index, children as a first-child/next-sibling chain. A node with a single
+ * child is never built: an and-or list of one pipeline is just that
+ * pipeline, and so on, so `ls` is one NODE_SIMPLE. Every node keeps its
+ * token range, for job listings.
+ *
+ *   list     := and_or ((';' | '&') and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') pipeline)*
+ *   pipeline := command ('|' command)*
+ *   command  := '{' list '}' | '(' list ')' | WORD+
+ */
+typedef struct {
+    int type;
+    int flags;
+    int child;
+    int next;
+    int first_token;
+    int num_tokens;
+} Node;
 
-        if (strlen(input) == 0 || input[0] == '#') {
-            continue;
-        }
+typedef struct {
+    Token *tokens;
+    int num_tokens;
+    int pos;
+    Node *nodes;
+    int num_nodes;
+    int error;
+} Ast;
 
-        char *pos = strstr(input, "$?");
-        if (pos != NULL) {
-            char exit_status[16];
-            snprintf(exit_status, sizeof(exit_status), "%d", errno);
-            strcpy(pos, exit_status);
+int add_node(Ast *ast, int type, int first_token) {
+    Node *node = &ast->nodes[ast->num_nodes];
+
+    node->type = type;
+    node->flags = 0;
+    node->child = -1;
+    node->next = -1;
+    node->first_token = first_token;
+    node->num_tokens = 0;
+
+    return ast->num_nodes++;
+}
+
+/* is_reserved: an unquoted word that is exactly word, like '{' or '}'. */
+int is_reserved(Ast *ast, const char *word) {
+    Token *token = &ast->tokens[ast->pos];
+
+    return ast->pos < ast->num_tokens && token->type == TOKEN_WORD && !token->quoted &&
+           (size_t)token->length == strlen(word) && strncmp(token->start, word, token->length) == 0;
+}
+
+int peek_type(Ast *ast) {
+    return ast->pos < ast->num_tokens ? ast->tokens[ast->pos].type : TOKEN_END;
+}
+
+int syntax_error(Ast *ast) {
+    if (!ast->error && !syntax_quiet) {
+        Token *token = &ast->tokens[ast->pos];
+
+        if (ast->pos < ast->num_tokens) {
+            fprintf(stderr, "syntax error near unexpected token `%.*s'\n", token->length, token->start);
         }
 
-        pos = strstr(input, "$$");
-        if (pos != NULL) {
-            char pid_str[16];
-            snprintf(pid_str, sizeof(pid_str), "%d", getpid());
-            strcpy(pos, pid_str);
+        else {
+            fprintf(stderr, "syntax error near unexpected token `newline'\n");
         }
+    }
+    ast->error = 1;
 
-        char *commands[MAX_INPUT_LENGTH];
-        char *token = strtok(input, ";");
+    return -1;
+}
 
-        int num_commands = 0;
-        while (token != NULL) {
-            commands[num_commands++] = strdup(token);
-            token = strtok(NULL, ";");
-        }
+int parse_list(Ast *ast);
 
-        int status = 0;
+int parse_command(Ast *ast) {
+    int start = ast->pos;
+    int index;
 
-        for (int i = 0; i < num_commands; i++) {
-            char *command;
-            char *args[MAX_INPUT_LENGTH];
+    if (peek_type(ast) == TOKEN_LPAREN || is_reserved(ast, "{")) {
+        int subshell = peek_type(ast) == TOKEN_LPAREN;
 
-            parse_command(commands[i], &command, args);
+        ast->pos++;
+        index = add_node(ast, subshell ? NODE_SUBSHELL : NODE_GROUP, start);
+        ast->nodes[index].child = parse_list(ast);
+        if (ast->nodes[index].child == -1) {
+            return -1;
+        }
 
-            if (strcmp(command, "exit") == 0) {
-                int exit_status = 0;
-                if (args[1] != NULL) {
-                    exit_status = atoi(args[1]);
-                }
-                printf("Exiting simple_shell with status %d.\n", exit_status);
-                exit(exit_status);
-            } 
-            
-            else if (strcmp(command, "setenv") == 0) {
-                if (args[1] != NULL && args[2] != NULL) {
-                    if (setenv(args[1], args[2], 1) != 0) {
-                        fprintf(stderr, "Failed to set environment variable %s\n", args[1]);
-                    }
-                } 
-                
-                else {
-                    fprintf(stderr, "Usage: setenv VARIABLE VALUE\n");
-                }
-            } 
-            
-            else if (strcmp(command, "unsetenv") == 0) {
-                if (args[1] != NULL) {
-                    if (unsetenv(args[1]) != 0) {
-                        fprintf(stderr, "Failed to unset environment variable %s\n", args[1]);
-                    }
-                } 
-                
-                else {
-                    fprintf(stderr, "Usage: unsetenv VARIABLE\n");
-                }
-            } 
-            
-            else if (strcmp(command, "cd") == 0) {
-                if (args[1] == NULL || strcmp(args[1], "~") == 0) {
-                   if (chdir(getenv("HOME")) != 0) {
-                        perror("chdir");
-                    }
-                } 
-                
-                else if (strcmp(args[1], "-") == 0) {
-                    char *prev_dir = getenv("OLDPWD");
-                    if (prev_dir != NULL && chdir(prev_dir) != 0) {
-                        perror("chdir");
-                    }
-                } 
-                
-                else {
-                    if (chdir(args[1]) != 0) {
-                        perror("chdir");
-                    }
-                }
+        if (subshell ? peek_type(ast) != TOKEN_RPAREN : !is_reserved(ast, "}")) {
+            return syntax_error(ast);
+        }
+        ast->pos++;
+    }
 
-                if (setenv("PWD", getcwd(cwd, sizeof(cwd)), 1) != 0) {
-                    perror("setenv");
-                }
-            } 
-            
-            else if (strcmp(command, "alias") == 0) {
-                if (args[1] == NULL) {
-                    list_aliases();
-                } 
-                
-                else if (args[2] == NULL) {
-                    print_aliases(args);
-                } 
-                
-                else {
-                    int j = 1;
-                    while (args[j] != NULL) {
-                        char *name = args[j];
-                        char *value = strchr(name, '=');
-
-                        if (value == NULL) {
-                            fprintf(stderr, "Invalid alias syntax: %s\n", name);
-                            break;
-                        }
+    else if (peek_type(ast) == TOKEN_WORD && !is_reserved(ast, "}")) {
+        index = add_node(ast, NODE_SIMPLE, start);
+        while (peek_type(ast) == TOKEN_WORD) {
+            ast->pos++;
+        }
+    }
+
+    else {
+        return syntax_error(ast);
+    }
 
-                        *value = '\0';
-                        value++;
+    ast->nodes[index].num_tokens = ast->pos - start;
+    return index;
+}
 
-                        define_alias(name, value);
+int parse_pipeline(Ast *ast) {
+    int start = ast->pos;
+    int first = parse_command(ast);
+    int last = first;
 
-                        j++;
-                    }
-                }
-            } 
-            
-            else {
-                if (status == 0) {
-                    if (strcmp(command, "&&") == 0) {
-                        status = execute_command(args[0], args + 1);
-                    } 
-                    
-                    else if (strcmp(command, "||") == 0) {
-                        status = execute_command(args[0], args + 1);
-                    } 
-                    
-                    else {
-                        status = execute_command(command, args);
-                    }
-                } 
-                
-                else {
-                    status = 0;
-                }
-            }
+    if (first == -1 || peek_type(ast) != TOKEN_PIPE) {
+        return first;
+    }
 
-            free(command);
-            for (int j = 0; args[j] != NULL; j++) {
-                free(args[j]);
+    int index = add_node(ast, NODE_PIPELINE, start);
+    int count = 1;
+
+    ast->nodes[index].child = first;
+    while (peek_type(ast) == TOKEN_PIPE) {
+        if (++count > MAX_PIPELINE) {
+            if (!syntax_quiet) {
+                fprintf(stderr, "pipeline: too many stages\n");
             }
+            ast->error = 1;
+            return -1;
         }
 
-        for (int i = 0; i < num_commands; i++) {
-            free(commands[i]);
+        ast->pos++;
+        last = ast->nodes[last].next = parse_command(ast);
+        if (last == -1) {
+            return -1;
         }
     }
 
-    for (int i = 0; i < num_aliases; i++) {
-        free(aliases[i].name);
-        free(aliases[i].value);
+    ast->nodes[index].num_tokens = ast->pos - start;
+    return index;
+}
+
+int parse_and_or(Ast *ast) {
+    int start = ast->pos;
+    int first = parse_pipeline(ast);
+    int last = first;
+
+    if (first == -1 || (peek_type(ast) != TOKEN_AND && peek_type(ast) != TOKEN_OR)) {
+        return first;
     }
 
+    int index = add_node(ast, NODE_AND_OR, start);
 
+    ast->nodes[index].child = first;
+    while (peek_type(ast) == TOKEN_AND || peek_type(ast) == TOKEN_OR) {
+        int flags = peek_type(ast) == TOKEN_AND ? NODE_IF_SUCCESS : NODE_IF_FAILURE;
+
+        ast->pos++;
+        last = ast->nodes[last].next = parse_pipeline(ast);
+        if (last == -1) {
+            return -1;
         }
+        ast->nodes[last].flags |= flags;
     }
-   printf("Exiting simple_shell.\n");
-    return 0;
+
+    ast->nodes[index].num_tokens = ast->pos - start;
+    return index;
 }
 
+/* A list ends at the end of the line, a ')' or a '}' in command position. */
+int parse_list(Ast *ast) {
+    int start = ast->pos;
+    int index = add_node(ast, NODE_LIST, start);
+    int last = -1;
+    int count = 0;
+
+    while (peek_type(ast) != TOKEN_END && peek_type(ast) != TOKEN_RPAREN && !is_reserved(ast, "}")) {
+        int item = parse_and_or(ast);
+
+        if (item == -1) {
+            return -1;
+        }
+
+        if (last == -1) {
+            ast->nodes[index].child = item;
+        }
+
+        else {
+            ast->nodes[last].next = item;
+        }
+        last = item;
+        count++;
+
+        if (peek_type(ast) == TOKEN_AMP) {
+            ast->nodes[item].flags |= NODE_ASYNC;
+        }
+
+        else if (peek_type(ast) != TOKEN_SEMI) {
+            break;
+        }
+        ast->pos++;
+    }
+
+    if (count == 0) {
+        return syntax_error(ast);
+    }
+
+    /* The list node is unused when a single synchronous item will do. */
+    if (count == 1 && !(ast->nodes[last].flags & NODE_ASYNC)) {
+        return last;
+    }
+
+    ast->nodes[index].num_tokens = ast->pos - start;
+    return index;
+}
+
+/* parse_line: build the AST for tokens. Returns the root index, or -1 after reporting a syntax error. */
+int parse_line(Ast *ast, Token *tokens, int num_tokens) {
+    ast->tokens = tokens;
+    ast->num_tokens = num_tokens;
+    ast->pos = 0;
+    ast->nodes = arena_alloc(&line_arena, (2 * num_tokens + 2) * sizeof(Node));
+    ast->num_nodes = 0;
+    ast->error = 0;
+
+    int root = parse_list(ast);
+
+    if (root != -1 && ast->pos < num_tokens) {
+        return syntax_error(ast);
+    }
+
+    return root;
+}
+
+/*
+ * Variables: the shell keeps its own, in an open-addressing table like the
+ * alias one, imported from environ at startup and never written back to it.
+ * Each slot holds "name=value" in one allocation, so an exported variable's
+ * string goes into envp as is. VAR_EXPORT marks what commands see; the envp
+ * array is rebuilt only when an exported variable changed since the last
+ * build (env_dirty), otherwise every command gets the same array. Unset
+ * keeps the slot with a NULL entry for the name to come back to.
+ */
+#define VAR_EXPORT 1
+
+void hash_clear(void);
+
+typedef struct {
+    char *name;
+    char *entry;
+    int flags;
+    unsigned int hash;
+} Var;
+
+Var *var_table = NULL;
+size_t var_capacity = 0;
+size_t num_vars = 0;
+
+char **var_envp = NULL;
+size_t var_envp_capacity = 0;
+int env_dirty = 1;
+unsigned long env_generation = 0;
+
+unsigned int hash_bytes(const char *str, size_t len) {
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* var_slot: the slot holding name, or the empty slot where it would go. */
+Var *var_slot(Var *table, size_t capacity, const char *name, size_t len, unsigned int hash) {
+    size_t i = hash & (capacity - 1);
+
+    while (table[i].name != NULL) {
+        if (table[i].hash == hash && strncmp(table[i].name, name, len) == 0 && table[i].name[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return &table[i];
+}
+
+/* var_lookup: the value of name[0..len), or NULL when it is unset. */
+const char *var_lookup(const char *name, size_t len) {
+    if (num_vars == 0) {
+        return NULL;
+    }
+
+    Var *var = var_slot(var_table, var_capacity, name, len, hash_bytes(name, len));
+    return var->entry != NULL ? var->entry + len + 1 : NULL;
+}
+
+const char *var_get(const char *name) {
+    return var_lookup(name, strlen(name));
+}
+
+/* var_find: the slot for name, added (unset) if the table has none yet. */
+Var *var_find(const char *name, size_t len) {
+    unsigned int hash = hash_bytes(name, len);
+
+    if ((num_vars + 1) * 2 > var_capacity) {
+        size_t capacity = var_capacity ? var_capacity * 2 : 256;
+        Var *table = calloc(capacity, sizeof(Var));
+
+        if (table == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < var_capacity; i++) {
+            if (var_table[i].name != NULL) {
+                *var_slot(table, capacity, var_table[i].name, strlen(var_table[i].name), var_table[i].hash) = var_table[i];
+            }
+        }
+
+        free(var_table);
+        var_table = table;
+        var_capacity = capacity;
+    }
+
+    Var *var = var_slot(var_table, var_capacity, name, len, hash);
+
+    if (var->name == NULL) {
+        var->name = strndup(name, len);
+        var->hash = hash;
+        if (var->name == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        num_vars++;
+    }
+
+    return var;
+}
+
+/*
+ * var_set: give name[0..len) value and add flags to it. Setting a variable
+ * to the value it already has changes nothing, so the environment of the
+ * next command is only rebuilt for a real change to an exported variable.
+ */
+void var_set(const char *name, size_t len, const char *value, int flags) {
+    Var *var = var_find(name, len);
+    size_t value_len = strlen(value);
+
+    if (var->entry != NULL && strcmp(var->entry + len + 1, value) == 0) {
+        env_dirty |= (flags & VAR_EXPORT) && !(var->flags & VAR_EXPORT);
+        var->flags |= flags;
+        return;
+    }
+
+    char *entry = malloc(len + value_len + 2);
+    if (entry == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    free(var->entry);
+    var->entry = entry;
+    var->flags |= flags;
+    env_dirty |= (var->flags & VAR_EXPORT) != 0;
+
+    /* Commands found under the old PATH may no longer be the right ones. */
+    if (len == 4 && memcmp(name, "PATH", 4) == 0) {
+        hash_clear();
+    }
+}
+
+void var_unset(const char *name) {
+    size_t len = strlen(name);
+
+    if (num_vars == 0) {
+        return;
+    }
+
+    Var *var = var_slot(var_table, var_capacity, name, len, hash_bytes(name, len));
+
+    if (var->entry != NULL) {
+        env_dirty |= (var->flags & VAR_EXPORT) != 0;
+        free(var->entry);
+        var->entry = NULL;
+        if (strcmp(name, "PATH") == 0) {
+            hash_clear();
+        }
+    }
+    var->flags = 0;
+}
+
+void var_export(const char *name, size_t len) {
+    Var *var = var_find(name, len);
+
+    env_dirty |= var->entry != NULL && !(var->flags & VAR_EXPORT);
+    var->flags |= VAR_EXPORT;
+}
+
+/* var_init: import the environment the shell was started with, all exported. */
+void var_init(void) {
+    for (char **env = environ; *env != NULL; env++) {
+        char *eq = strchr(*env, '=');
+
+        if (eq != NULL && eq != *env) {
+            var_set(*env, eq - *env, eq + 1, VAR_EXPORT);
+        }
+    }
+}
+
+/* var_environ: envp for the next command, rebuilt only if an exported variable changed. */
+char **var_environ(void) {
+    size_t count = 0;
+
+    if (!env_dirty && var_envp != NULL) {
+        return var_envp;
+    }
+
+    if (num_vars + 1 > var_envp_capacity) {
+        var_envp_capacity = (num_vars + 1) * 2;
+        var_envp = realloc(var_envp, var_envp_capacity * sizeof(char *));
+        if (var_envp == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < var_capacity; i++) {
+        if (var_table[i].entry != NULL && (var_table[i].flags & VAR_EXPORT)) {
+            var_envp[count++] = var_table[i].entry;
+        }
+    }
+    var_envp[count] = NULL;
+
+    env_dirty = 0;
+    env_generation++;
+    return var_envp;
+}
+
+/* name_length: the length of the variable name word starts with, 0 if none. */
+size_t name_length(const char *word) {
+    size_t len = 0;
+
+    if (!isalpha((unsigned char)*word) && *word != '_') {
+        return 0;
+    }
+
+    while (isalnum((unsigned char)word[len]) || word[len] == '_') {
+        len++;
+    }
+
+    return len;
+}
+
+/* is_assignment: word has the form NAME=value; returns the length of NAME or 0. */
+size_t is_assignment(const char *word) {
+    size_t len = name_length(word);
+
+    return len > 0 && word[len] == '=' ? len : 0;
+}
+
+/*
+ * split_assignments: count the NAME=value words argv starts with. When a
+ * command follows them, *envp is set to the environment of that command
+ * alone: the assignments, then the exported variables they do not override.
+ */
+int split_assignments(char **argv, char ***envp) {
+    int n = 0;
+
+    *envp = NULL;
+    while (argv[n] != NULL && is_assignment(argv[n])) {
+        n++;
+    }
+
+    if (n == 0 || argv[n] == NULL) {
+        return n;
+    }
+
+    char **env = var_environ();
+    size_t count = 0;
+
+    while (env[count] != NULL) {
+        count++;
+    }
+
+    char **result = arena_alloc(&line_arena, (n + count + 1) * sizeof(char *));
+    size_t k = 0;
+
+    for (int i = 0; i < n; i++) {
+        result[k++] = argv[i];
+    }
+
+    for (size_t j = 0; j < count; j++) {
+        size_t len = strchr(env[j], '=') - env[j];
+        int overridden = 0;
+
+        for (int i = 0; i < n && !overridden; i++) {
+            overridden = is_assignment(argv[i]) == len && strncmp(argv[i], env[j], len) == 0;
+        }
+
+        if (!overridden) {
+            result[k++] = env[j];
+        }
+    }
+    result[k] = NULL;
+
+    *envp = result;
+    return n;
+}
+
+/*
+ * Launch backends. posix_spawn and the CLONE_VFORK clone share the parent's
+ * address space until exec, so neither pays to copy the page tables the way
+ * fork() does. fork is only used when the child has to run shell code
+ * (child_fn) instead of exec'ing straight away.
+ */
+typedef enum {
+    SPAWN_POSIX,
+    SPAWN_VFORK,
+    SPAWN_FORK,
+    SPAWN_ZYGOTE
+} SpawnBackend;
+
+typedef struct {
+    int from;
+    int to;
+} SpawnAction;
+
+typedef struct {
+    char *path;
+    char **argv;
+    char **envp;
+    SpawnAction actions[SPAWN_MAX_ACTIONS];
+    int num_actions;
+    int (*child_fn)(void *data);
+    void *child_data;
+} SpawnRequest;
+
+typedef struct {
+    SpawnRequest *req;
+    sigset_t *mask;
+    int error;
+} VforkChild;
+
+SpawnBackend spawn_backend(void) {
+    const char *name = var_get("SIMPLE_SHELL_SPAWN");
+
+    if (name == NULL || strcmp(name, "posix_spawn") == 0) {
+        return SPAWN_POSIX;
+    }
+
+    else if (strcmp(name, "vfork") == 0) {
+        return SPAWN_VFORK;
+    }
+
+    else if (strcmp(name, "fork") == 0) {
+        return SPAWN_FORK;
+    }
+
+    else if (strcmp(name, "zygote") == 0) {
+        return SPAWN_ZYGOTE;
+    }
+
+    return SPAWN_POSIX;
+}
+
+void spawn_add_dup2(SpawnRequest *req, int from, int to) {
+    if (req->num_actions < SPAWN_MAX_ACTIONS) {
+        req->actions[req->num_actions].from = from;
+        req->actions[req->num_actions].to = to;
+        req->num_actions++;
+    }
+}
+
+void spawn_add_close(SpawnRequest *req, int fd) {
+    spawn_add_dup2(req, -1, fd);
+}
+
+/* Runs in the child of every backend, before exec. */
+void spawn_apply_actions(SpawnRequest *req) {
+    for (int i = 0; i < req->num_actions; i++) {
+        if (req->actions[i].from == -1) {
+            close(req->actions[i].to);
+        }
+
+        else if (req->actions[i].from != req->actions[i].to) {
+            dup2(req->actions[i].from, req->actions[i].to);
+        }
+    }
+}
+
+/* Handlers installed by the shell must not run in a child that shares our memory. */
+void spawn_reset_signals(void) {
+    struct sigaction sa;
+
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+            sa.sa_handler = SIG_DFL;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = 0;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+}
+
+pid_t spawn_posix(SpawnRequest *req, int *error) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    struct sigaction sa;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < req->num_actions; i++) {
+        if (req->actions[i].from == -1) {
+            posix_spawn_file_actions_addclose(&actions, req->actions[i].to);
+        }
+
+        else {
+            posix_spawn_file_actions_adddup2(&actions, req->actions[i].from, req->actions[i].to);
+        }
+    }
+
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+            sigaddset(&defaults, sig);
+        }
+    }
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (req->path != NULL) {
+        *error = posix_spawn(&pid, req->path, &actions, &attr, req->argv, req->envp);
+    }
+
+    else {
+        *error = posix_spawnp(&pid, req->argv[0], &actions, &attr, req->argv, req->envp);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return *error == 0 ? pid : -1;
+}
+
+int spawn_vfork_child(void *data) {
+    VforkChild *child = data;
+
+    spawn_reset_signals();
+    sigprocmask(SIG_SETMASK, child->mask, NULL);
+    spawn_apply_actions(child->req);
+
+    if (child->req->path != NULL) {
+        execve(child->req->path, child->req->argv, child->req->envp);
+    }
+
+    else {
+        execvpe(child->req->argv[0], child->req->argv, child->req->envp);
+    }
+
+    /* Same address space: the parent reads this once we are gone. */
+    child->error = errno;
+    _exit(127);
+}
+
+pid_t spawn_vfork(SpawnRequest *req, int *error) {
+    static char *stack = NULL;
+    VforkChild child;
+    sigset_t all, old;
+    pid_t pid;
+
+    if (stack == NULL) {
+        stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+            stack = NULL;
+            *error = errno;
+            return -1;
+        }
+    }
+
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+
+    child.req = req;
+    child.mask = &old;
+    child.error = 0;
+
+    /* CLONE_VFORK suspends us until the child execs or exits, so one stack is enough. */
+    pid = clone(spawn_vfork_child, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    *error = pid == -1 ? errno : child.error;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (pid != -1 && child.error != 0) {
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    return pid;
+}
+
+pid_t spawn_fork(SpawnRequest *req, int *error) {
+    if (req->child_fn != NULL) {
+        fflush(NULL);
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        *error = errno;
+        return -1;
+    }
+
+    else if (pid == 0) {
+        spawn_reset_signals();
+        spawn_apply_actions(req);
+
+        if (req->child_fn != NULL) {
+            close_range(3, ~0U, 0);
+            _exit(req->child_fn(req->child_data));
+        }
+
+        if (req->path != NULL) {
+            execve(req->path, req->argv, req->envp);
+        }
+
+        else {
+            execvpe(req->argv[0], req->argv, req->envp);
+        }
+
+        fprintf(stderr, "%s: %s\n", req->argv[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+
+    *error = 0;
+    return pid;
+}
+
+/*
+ * Zygote backend (SIMPLE_SHELL_SPAWN=zygote): a helper forked at startup,
+ * while the shell is still small, does the fork/exec for us. Requests carry
+ * argv, the environment (only when it changed since the last request), the
+ * redirection list, and the fds themselves (stdio, cwd, redirect sources)
+ * as SCM_RIGHTS. The helper double-forks so the command is orphaned onto the
+ * shell, which is a child subreaper; waitpid and SIGCHLD then work exactly
+ * as for the other backends.
+ */
+typedef struct {
+    uint32_t payload_len;
+    uint32_t num_fds;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t num_actions;
+    uint32_t has_path;
+    SpawnAction actions[SPAWN_MAX_ACTIONS];
+} ZygoteRequest;
+
+typedef struct {
+    int32_t pid;
+    int32_t error;
+} ZygoteReply;
+
+int zygote_fd = -1;
+int zygote_cwd_fd = -1;
+unsigned long zygote_sent_generation = 0;
+
+int read_full(int fd, void *buffer, size_t len) {
+    char *p = buffer;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int write_full(int fd, const void *buffer, size_t len) {
+    const char *p = buffer;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Runs in the helper: start one command, returning its pid or -error. */
+pid_t zygote_launch(ZygoteRequest *request, int *fds, char *path, char **argv, char **envp) {
+    int status_pipe[2];
+    pid_t middle, pid = -1;
+    int error = 0;
+
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        return -errno;
+    }
+
+    middle = fork();
+    if (middle == 0) {
+        pid = fork();
+        if (pid != 0) {
+            /* Tell the helper who to report, then orphan the command onto the shell. */
+            write_full(status_pipe[1], &pid, sizeof(pid));
+            _exit(pid == -1 ? 1 : 0);
+        }
+
+        fchdir(fds[3]);
+        for (int fd = 0; fd < 3; fd++) {
+            dup2(fds[fd], fd);
+        }
+        for (uint32_t i = 0; i < request->num_actions; i++) {
+            if (request->actions[i].from == -1) {
+                close(request->actions[i].to);
+            }
+
+            else {
+                dup2(fds[request->actions[i].from], request->actions[i].to);
+            }
+        }
+
+        if (path != NULL) {
+            execve(path, argv, envp);
+        }
+
+        else {
+            execvpe(argv[0], argv, envp);
+        }
+
+        error = errno;
+        write_full(status_pipe[1], &error, sizeof(error));
+        _exit(127);
+    }
+
+    close(status_pipe[1]);
+
+    if (middle == -1 || read_full(status_pipe[0], &pid, sizeof(pid)) == -1 || pid == -1) {
+        error = middle == -1 ? errno : EAGAIN;
+        pid = -1;
+    }
+
+    if (middle != -1) {
+        waitpid(middle, NULL, 0);
+    }
+
+    /* EOF here means the exec succeeded; a value is the exec errno. */
+    if (pid != -1 && read_full(status_pipe[0], &error, sizeof(error)) == 0) {
+        pid = -1;
+    }
+
+    close(status_pipe[0]);
+    return pid == -1 ? -(error != 0 ? error : EAGAIN) : pid;
+}
+
+void zygote_main(int fd) {
+    char **envp = environ;
+    char *env_strings = NULL;
+
+    while (1) {
+        ZygoteRequest request;
+        char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr msg;
+        int fds[ZYGOTE_MAX_FDS];
+        int num_fds = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(request)) {
+            _exit(0);
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+            }
+        }
+
+        char *payload = malloc(request.payload_len + 1);
+        char **argv = malloc((request.argc + 1) * sizeof(char *));
+        if (payload == NULL || argv == NULL || read_full(fd, payload, request.payload_len) == -1) {
+            _exit(1);
+        }
+
+        char *p = payload;
+        char *path = NULL;
+
+        if (request.has_path) {
+            path = p;
+            p += strlen(p) + 1;
+        }
+
+        for (uint32_t i = 0; i < request.argc; i++) {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+        argv[request.argc] = NULL;
+
+        /* A new environment replaces the one kept from earlier requests. */
+        if (request.envc != ZYGOTE_ENV_UNCHANGED) {
+            if (envp != environ) {
+                free(envp);
+                free(env_strings);
+            }
+
+            envp = malloc((request.envc + 1) * sizeof(char *));
+            env_strings = malloc(request.payload_len - (p - payload) + 1);
+            if (envp == NULL || env_strings == NULL) {
+                _exit(1);
+            }
+
+            memcpy(env_strings, p, request.payload_len - (p - payload));
+            p = env_strings;
+            for (uint32_t i = 0; i < request.envc; i++) {
+                envp[i] = p;
+                p += strlen(p) + 1;
+            }
+            envp[request.envc] = NULL;
+        }
+
+        ZygoteReply reply = {-1, EINVAL};
+
+        if ((uint32_t)num_fds == request.num_fds && num_fds >= 4) {
+            pid_t pid = zygote_launch(&request, fds, path, argv, envp);
+
+            reply.pid = pid > 0 ? pid : -1;
+            reply.error = pid > 0 ? 0 : -pid;
+        }
+
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        free(argv);
+        free(payload);
+
+        if (write_full(fd, &reply, sizeof(reply)) == -1) {
+            _exit(0);
+        }
+    }
+}
+
+/* zygote_start: fork the helper; call before the shell allocates anything big. */
+void zygote_start(void) {
+    const char *name = var_get("SIMPLE_SHELL_SPAWN");
+    int sv[2];
+
+    if (name == NULL || strcmp(name, "zygote") != 0) {
+        return;
+    }
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("zygote");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+
+    else if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+void zygote_stop(void) {
+    if (zygote_fd != -1) {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
+
+/* The cwd is sent as an fd; cd drops it so the next launch reopens ".". */
+void zygote_cwd_changed(void) {
+    if (zygote_cwd_fd != -1) {
+        close(zygote_cwd_fd);
+        zygote_cwd_fd = -1;
+    }
+}
+
+pid_t spawn_zygote(SpawnRequest *req, int *error) {
+    ZygoteRequest request;
+    ZygoteReply reply;
+    int fds[ZYGOTE_MAX_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1};
+    size_t envc = 0;
+    size_t payload_len = 0;
+
+    if (zygote_cwd_fd == -1) {
+        zygote_cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    fds[3] = zygote_cwd_fd;
+
+    memset(&request, 0, sizeof(request));
+    request.num_fds = 4;
+    request.num_actions = req->num_actions;
+    request.has_path = req->path != NULL;
+
+    for (int i = 0; i < req->num_actions; i++) {
+        request.actions[i] = req->actions[i];
+        if (req->actions[i].from != -1) {
+            fds[request.num_fds] = req->actions[i].from;
+            request.actions[i].from = request.num_fds++;
+        }
+    }
+
+    while (req->envp[envc] != NULL) {
+        envc++;
+    }
+
+    /* var_environ() hands out a new generation whenever an exported variable changed. */
+    int env_changed = req->envp != var_envp || env_generation != zygote_sent_generation;
+
+    request.envc = env_changed ? envc : ZYGOTE_ENV_UNCHANGED;
+
+    if (req->path != NULL) {
+        payload_len += strlen(req->path) + 1;
+    }
+    for (request.argc = 0; req->argv[request.argc] != NULL; request.argc++) {
+        payload_len += strlen(req->argv[request.argc]) + 1;
+    }
+    for (size_t i = 0; env_changed && i < envc; i++) {
+        payload_len += strlen(req->envp[i]) + 1;
+    }
+    request.payload_len = payload_len;
+
+    char *payload = malloc(payload_len);
+    char *p = payload;
+
+    if (payload == NULL) {
+        *error = ENOMEM;
+        return -1;
+    }
+
+    if (req->path != NULL) {
+        p = stpcpy(p, req->path) + 1;
+    }
+    for (uint32_t i = 0; i < request.argc; i++) {
+        p = stpcpy(p, req->argv[i]) + 1;
+    }
+    for (size_t i = 0; env_changed && i < envc; i++) {
+        p = stpcpy(p, req->envp[i]) + 1;
+    }
+
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(request.num_fds * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(request.num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, request.num_fds * sizeof(int));
+
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) != sizeof(request)
+        || write_full(zygote_fd, payload, payload_len) == -1
+        || read_full(zygote_fd, &reply, sizeof(reply)) == -1) {
+        /* The helper is gone: carry on without it. */
+        free(payload);
+        zygote_stop();
+        return spawn_posix(req, error);
+    }
+
+    free(payload);
+
+    if (env_changed) {
+        zygote_sent_generation = req->envp == var_envp ? env_generation : 0;
+    }
+
+    *error = reply.error;
+    return reply.pid;
+}
+
+/*
+ * spawn_process: start req->argv with the backend picked by SIMPLE_SHELL_SPAWN
+ * (posix_spawn, vfork, fork or zygote). Returns the child pid, or -1 with *error set
+ * when the command could not be started.
+ */
+pid_t spawn_process(SpawnRequest *req, int *error) {
+    /* Builtin output still sitting in stdio must come before the child's. */
+    fflush(stdout);
+
+    if (req->envp == NULL) {
+        req->envp = var_environ();
+    }
+
+    if (req->child_fn != NULL) {
+        return spawn_fork(req, error);
+    }
+
+    switch (spawn_backend()) {
+        case SPAWN_VFORK:
+            return spawn_vfork(req, error);
+
+        case SPAWN_FORK:
+            return spawn_fork(req, error);
+
+        case SPAWN_ZYGOTE:
+            if (zygote_fd != -1) {
+                return spawn_zygote(req, error);
+            }
+            return spawn_posix(req, error);
+
+        default:
+            return spawn_posix(req, error);
+    }
+}
+
+int wait_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+
+    else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+
+    return -1;
+}
+
+/*
+ * Command hash: name -> absolute path, filled on first lookup so PATH is
+ * scanned once per command rather than on every launch. Misses are kept
+ * (path == NULL) as a negative cache. The table is flushed whenever PATH is
+ * set or unset (var_set, var_unset).
+ */
+typedef struct CommandEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct CommandEntry *next;
+} CommandEntry;
+
+CommandEntry *command_table[COMMAND_HASH_SIZE];
+
+void hash_clear_table(void);
+
+unsigned int hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    while (*str != '\0') {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+
+    return hash;
+}
+
+char *search_path(const char *command) {
+    const char *path_env = var_get("PATH");
+    if (path_env == NULL) {
+        return NULL;
+    }
+
+    size_t command_len = strlen(command);
+    const char *dir = path_env;
+
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end != NULL ? (size_t)(end - dir) : strlen(dir);
+        char path_buffer[PATH_MAX];
+
+        if (dir_len == 0) {
+            dir = ".";
+            dir_len = 1;
+        }
+
+        if (dir_len + command_len + 2 <= sizeof(path_buffer)) {
+            memcpy(path_buffer, dir, dir_len);
+            path_buffer[dir_len] = '/';
+            memcpy(path_buffer + dir_len + 1, command, command_len + 1);
+
+            if (access(path_buffer, X_OK) == 0) {
+                return strdup(path_buffer);
+            }
+        }
+
+        if (end == NULL) {
+            break;
+        }
+        dir = end + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Shared command index: one file per PATH value under $SIMPLE_SHELL_INDEX,
+ * holding a fingerprint (dev, inode, mtime) of every PATH directory and the
+ * executable names found in them, sorted by hash. Every shell maps the same
+ * file read-only, so the page cache holds a single copy and a shell that
+ * finds a fresh index does no PATH probing at all. A stale index is rebuilt
+ * into a temporary file and renamed over the old one. With
+ * SIMPLE_SHELL_INDEX_WATCH=1 an inotify watch on the PATH directories
+ * triggers the rebuild as soon as something is installed or removed.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_names;
+    uint32_t path_hash;
+    uint64_t size;
+} IndexHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t name_off;
+    uint32_t name_len;
+} IndexDir;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t dir;
+    uint32_t name_off;
+    uint32_t name_len;
+} IndexName;
+
+typedef struct {
+    char *map;
+    size_t size;
+    int state;
+    int watch_fd;
+} CommandIndex;
+
+CommandIndex command_index = {NULL, 0, INDEX_UNKNOWN, -1};
+
+char *index_file_name(const char *path_env) {
+    const char *dir = var_get("SIMPLE_SHELL_INDEX");
+    char *name;
+
+    if (dir == NULL || *dir == '\0') {
+        return NULL;
+    }
+
+    if (asprintf(&name, "%s/cmdindex-%08x", dir, hash_string(path_env)) == -1) {
+        return NULL;
+    }
+
+    return name;
+}
+
+/* Splits PATH into its directories; empty entries mean the current directory. */
+int index_path_dirs(char *path_copy, char **dirs, int max_dirs) {
+    int count = 0;
+    char *dir = path_copy;
+
+    while (dir != NULL && count < max_dirs) {
+        char *end = strchr(dir, ':');
+        if (end != NULL) {
+            *end = '\0';
+        }
+
+        dirs[count++] = *dir != '\0' ? dir : ".";
+        dir = end != NULL ? end + 1 : NULL;
+    }
+
+    return count;
+}
+
+void index_fingerprint(const char *dir, IndexDir *record) {
+    struct stat st;
+
+    memset(record, 0, sizeof(*record));
+    if (stat(dir, &st) == 0) {
+        record->dev = st.st_dev;
+        record->ino = st.st_ino;
+        record->mtime_sec = st.st_mtim.tv_sec;
+        record->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+int index_compare_names(const void *a, const void *b) {
+    const IndexName *x = a;
+    const IndexName *y = b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+
+    if (x->dir != y->dir) {
+        return x->dir < y->dir ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* index_valid: the mapped index describes exactly the current PATH directories. */
+int index_valid(const char *map, size_t size, const char *path_env) {
+    const IndexHeader *header = (const IndexHeader *)map;
+
+    if (size < sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, 8) != 0
+        || header->version != INDEX_VERSION || header->size != size
+        || header->path_hash != hash_string(path_env)) {
+        return 0;
+    }
+
+    char *path_copy = strdup(path_env);
+    char *dirs[INDEX_MAX_DIRS];
+    int num_dirs = index_path_dirs(path_copy, dirs, INDEX_MAX_DIRS);
+    const IndexDir *records = (const IndexDir *)(map + sizeof(IndexHeader));
+    int valid = header->num_dirs == (uint32_t)num_dirs;
+
+    for (int i = 0; valid && i < num_dirs; i++) {
+        IndexDir current;
+
+        index_fingerprint(dirs[i], &current);
+        valid = records[i].name_len == strlen(dirs[i])
+            && memcmp(map + records[i].name_off, dirs[i], records[i].name_len) == 0
+            && records[i].dev == current.dev && records[i].ino == current.ino
+            && records[i].mtime_sec == current.mtime_sec
+            && records[i].mtime_nsec == current.mtime_nsec;
+    }
+
+    free(path_copy);
+    return valid;
+}
+
+/* index_build: scan every PATH directory once and write the index atomically. */
+int index_build(const char *file_name, const char *path_env) {
+    char *path_copy = strdup(path_env);
+    char *dirs[INDEX_MAX_DIRS];
+    int num_dirs = index_path_dirs(path_copy, dirs, INDEX_MAX_DIRS);
+    IndexDir records[INDEX_MAX_DIRS];
+    IndexName *names = NULL;
+    size_t num_names = 0, names_cap = 0;
+    char *strings = NULL;
+    size_t strings_len = 0, strings_cap = 0;
+
+    for (int i = 0; i < num_dirs; i++) {
+        size_t len = strlen(dirs[i]);
+
+        /* Fingerprint before reading so a concurrent change leaves the index stale, not wrong. */
+        index_fingerprint(dirs[i], &records[i]);
+
+        if (strings_len + len + 1 > strings_cap) {
+            strings_cap = (strings_len + len + 1) * 2;
+            strings = realloc(strings, strings_cap);
+        }
+        records[i].name_off = strings_len;
+        records[i].name_len = len;
+        memcpy(strings + strings_len, dirs[i], len + 1);
+        strings_len += len + 1;
+
+        int dir_fd = open(dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = dir_fd != -1 ? fdopendir(dir_fd) : NULL;
+        struct dirent *entry;
+
+        if (dir == NULL) {
+            if (dir_fd != -1) {
+                close(dir_fd);
+            }
+            continue;
+        }
+
+        while ((entry = readdir(dir)) != NULL) {
+            struct stat st;
+
+            if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0'
+                || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+                continue;
+            }
+
+            if (fstatat(dir_fd, entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)
+                || faccessat(dir_fd, entry->d_name, X_OK, AT_EACCESS) != 0) {
+                continue;
+            }
+
+            len = strlen(entry->d_name);
+            if (num_names == names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 256;
+                names = realloc(names, names_cap * sizeof(IndexName));
+            }
+            if (strings_len + len + 1 > strings_cap) {
+                strings_cap = (strings_len + len + 1) * 2;
+                strings = realloc(strings, strings_cap);
+            }
+            if (names == NULL || strings == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+
+            names[num_names].hash = hash_string(entry->d_name);
+            names[num_names].dir = i;
+            names[num_names].name_off = strings_len;
+            names[num_names].name_len = len;
+            num_names++;
+
+            memcpy(strings + strings_len, entry->d_name, len + 1);
+            strings_len += len + 1;
+        }
+
+        closedir(dir);
+    }
+
+    if (names != NULL) {
+        qsort(names, num_names, sizeof(IndexName), index_compare_names);
+    }
+
+    size_t strings_start = sizeof(IndexHeader) + num_dirs * sizeof(IndexDir) + num_names * sizeof(IndexName);
+    IndexHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.num_dirs = num_dirs;
+    header.num_names = num_names;
+    header.path_hash = hash_string(path_env);
+    header.size = strings_start + strings_len;
+
+    for (int i = 0; i < num_dirs; i++) {
+        records[i].name_off += strings_start;
+    }
+    for (size_t i = 0; i < num_names; i++) {
+        names[i].name_off += strings_start;
+    }
+
+    char *tmp_name;
+    int written = 0;
+
+    if (asprintf(&tmp_name, "%s.%d", file_name, getpid()) != -1) {
+        FILE *out = fopen(tmp_name, "w");
+
+        if (out != NULL) {
+            written = fwrite(&header, sizeof(header), 1, out) == 1
+                && fwrite(records, sizeof(IndexDir), num_dirs, out) == (size_t)num_dirs
+                && fwrite(names, sizeof(IndexName), num_names, out) == num_names
+                && fwrite(strings, 1, strings_len, out) == strings_len;
+            written = fclose(out) == 0 && written && rename(tmp_name, file_name) == 0;
+
+            if (!written) {
+                unlink(tmp_name);
+            }
+        }
+
+        free(tmp_name);
+    }
+
+    free(names);
+    free(strings);
+    free(path_copy);
+    return written;
+}
+
+void index_close(void) {
+    if (command_index.map != NULL) {
+        munmap(command_index.map, command_index.size);
+    }
+
+    if (command_index.watch_fd != -1) {
+        close(command_index.watch_fd);
+    }
+
+    command_index.map = NULL;
+    command_index.size = 0;
+    command_index.watch_fd = -1;
+    command_index.state = INDEX_UNKNOWN;
+}
+
+int index_map(const char *file_name, const char *path_env) {
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char *map;
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    if (!index_valid(map, st.st_size, path_env)) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    command_index.map = map;
+    command_index.size = st.st_size;
+    return 1;
+}
+
+void index_watch(const char *path_env) {
+    const char *watch = var_get("SIMPLE_SHELL_INDEX_WATCH");
+
+    if (watch == NULL || strcmp(watch, "1") != 0) {
+        return;
+    }
+
+    command_index.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (command_index.watch_fd == -1) {
+        return;
+    }
+
+    char *path_copy = strdup(path_env);
+    char *dirs[INDEX_MAX_DIRS];
+    int num_dirs = index_path_dirs(path_copy, dirs, INDEX_MAX_DIRS);
+
+    for (int i = 0; i < num_dirs; i++) {
+        inotify_add_watch(command_index.watch_fd, dirs[i],
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    }
+
+    free(path_copy);
+}
+
+/* index_open: map a fresh index for the current PATH, rebuilding it if needed. */
+void index_open(void) {
+    const char *path_env = var_get("PATH");
+    char *file_name = path_env != NULL ? index_file_name(path_env) : NULL;
+
+    if (command_index.map != NULL) {
+        munmap(command_index.map, command_index.size);
+        command_index.map = NULL;
+    }
+
+    command_index.state = INDEX_DISABLED;
+    if (file_name == NULL) {
+        return;
+    }
+
+    if (index_map(file_name, path_env) || (index_build(file_name, path_env) && index_map(file_name, path_env))) {
+        command_index.state = INDEX_READY;
+        if (command_index.watch_fd == -1) {
+            index_watch(path_env);
+        }
+    }
+
+    free(file_name);
+}
+
+/* Drains pending inotify events; any change in a PATH directory means a rebuild. */
+void index_poll(void) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    while (read(command_index.watch_fd, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+
+    if (changed) {
+        hash_clear_table();
+        index_open();
+    }
+}
+
+/*
+ * index_lookup: answer a PATH lookup from the shared index. Returns 0 when no
+ * index is usable; otherwise 1 with *path set to the malloc'd absolute path,
+ * or NULL when the index says the command is not on PATH.
+ */
+int index_lookup(const char *name, char **path) {
+    if (command_index.state == INDEX_UNKNOWN) {
+        index_open();
+    }
+
+    if (command_index.state != INDEX_READY) {
+        return 0;
+    }
+
+    const IndexHeader *header = (const IndexHeader *)command_index.map;
+    const IndexDir *dirs = (const IndexDir *)(command_index.map + sizeof(IndexHeader));
+    const IndexName *names = (const IndexName *)(dirs + header->num_dirs);
+    uint32_t hash = hash_string(name);
+    size_t len = strlen(name);
+    size_t low = 0, high = header->num_names;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (names[mid].hash < hash) {
+            low = mid + 1;
+        }
+
+        else {
+            high = mid;
+        }
+    }
+
+    *path = NULL;
+
+    /* Equal hashes are sorted by PATH order, so the first match wins as with execvp. */
+    for (size_t i = low; i < header->num_names && names[i].hash == hash; i++) {
+        if (names[i].name_len == len && memcmp(command_index.map + names[i].name_off, name, len) == 0) {
+            const IndexDir *dir = &dirs[names[i].dir];
+
+            if (asprintf(path, "%.*s/%s", (int)dir->name_len, command_index.map + dir->name_off, name) == -1) {
+                *path = NULL;
+            }
+            break;
+        }
+    }
+
+    return 1;
+}
+
+CommandEntry *hash_find(const char *name) {
+    unsigned int bucket = hash_string(name) % COMMAND_HASH_SIZE;
+
+    for (CommandEntry *entry = command_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* hash_lookup: cached absolute path for name, or NULL if it is not on PATH. */
+char *hash_lookup(const char *name) {
+    if (command_index.watch_fd != -1) {
+        index_poll();
+    }
+
+    CommandEntry *entry = hash_find(name);
+
+    if (entry == NULL) {
+        unsigned int bucket = hash_string(name) % COMMAND_HASH_SIZE;
+
+        entry = malloc(sizeof(CommandEntry));
+        if (entry == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        entry->name = strdup(name);
+        if (!index_lookup(name, &entry->path)) {
+            entry->path = search_path(name);
+        }
+        entry->hits = 0;
+        entry->next = command_table[bucket];
+        command_table[bucket] = entry;
+    }
+
+    if (entry->path != NULL) {
+        entry->hits++;
+    }
+
+    return entry->path;
+}
+
+void hash_remove(const char *name) {
+    unsigned int bucket = hash_string(name) % COMMAND_HASH_SIZE;
+    CommandEntry **link = &command_table[bucket];
+
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            CommandEntry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+void hash_clear_table(void) {
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+        CommandEntry *entry = command_table[i];
+
+        while (entry != NULL) {
+            CommandEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+
+        command_table[i] = NULL;
+    }
+}
+
+/* hash_clear: forget every cached lookup, including the shared index mapping. */
+void hash_clear(void) {
+    hash_clear_table();
+    index_close();
+}
+
+/* hash: list the table, -r to clear it, -p (or bare names) to pre-warm it. */
+int builtin_hash(char **args) {
+    if (args[1] == NULL) {
+        int empty = 1;
+
+        for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+            for (CommandEntry *entry = command_table[i]; entry != NULL; entry = entry->next) {
+                if (entry->path == NULL) {
+                    continue;
+                }
+
+                if (empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+
+        if (empty) {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0) {
+        hash_clear();
+        return 0;
+    }
+
+    int status = 0;
+    int first = strcmp(args[1], "-p") == 0 ? 2 : 1;
+
+    for (int i = first; args[i] != NULL; i++) {
+        if (strchr(args[i], '/') != NULL) {
+            continue;
+        }
+
+        hash_remove(args[i]);
+        if (hash_lookup(args[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+
+        else {
+            hash_find(args[i])->hits = 0;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * launch_command: resolve args[0] and start it with req's redirections.
+ * Returns the pid, or -1 with *status set to 127/126 when it cannot run.
+ */
+/* exceeds_arg_max: whether execve would refuse args plus envp with E2BIG. */
+int exceeds_arg_max(char **args, char **envp) {
+    static long arg_max = 0;
+    size_t size = 0;
+
+    if (arg_max == 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) {
+            arg_max = LONG_MAX;
+        }
+    }
+
+    for (int i = 0; args[i] != NULL; i++) {
+        size += strlen(args[i]) + 1 + sizeof(char *);
+    }
+    for (int i = 0; envp[i] != NULL; i++) {
+        size += strlen(envp[i]) + 1 + sizeof(char *);
+    }
+
+    return size > (size_t)arg_max;
+}
+
+pid_t launch_command(char **args, SpawnRequest *req, int *status) {
+    char *command = args[0];
+    int error;
+
+    req->argv = args;
+    if (req->envp == NULL) {
+        req->envp = var_environ();
+    }
+
+    if (exceeds_arg_max(args, req->envp)) {
+        fprintf(stderr, "%s: %s\n", command, strerror(E2BIG));
+        *status = 126;
+        return -1;
+    }
+
+    if (strchr(command, '/') == NULL) {
+        req->path = hash_lookup(command);
+        if (req->path == NULL) {
+            fprintf(stderr, "%s: command not found\n", command);
+            *status = 127;
+            return -1;
+        }
+    }
+
+    pid_t pid = spawn_process(req, &error);
+
+    /* The cached binary moved or was removed: look it up once more. */
+    if (pid == -1 && error == ENOENT && req->path != NULL) {
+        hash_remove(command);
+        if (command_index.state == INDEX_READY) {
+            index_open();
+        }
+        req->path = hash_lookup(command);
+        if (req->path != NULL) {
+            pid = spawn_process(req, &error);
+        }
+    }
+
+    if (pid == -1) {
+        fprintf(stderr, "%s: %s\n", command, strerror(error));
+        *status = error == ENOENT ? 127 : 126;
+    }
+
+    return pid;
+}
+
+int execute_command(char *command, char **args, char **envp) {
+    SpawnRequest req = {0};
+    int status;
+
+    (void)command;
+    req.envp = envp;
+    pid_t pid = launch_command(args, &req, &status);
+
+    if (pid == -1) {
+        return status;
+    }
+
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+
+    return wait_status(status);
+}
+
+/*
+ * Aliases: an open-addressing table (linear probing, power-of-two size,
+ * at most half full) keyed by FNV-1a of the name. Each value is lexed once
+ * when it is defined, into tokens over a private copy of the text, so
+ * expanding an alias is a copy of its tokens into the line's token array.
+ * Only words in command position are looked up; an alias whose value ends
+ * in a blank makes the next word eligible too. An alias is not expanded
+ * again inside its own expansion, which stops `alias ls='ls -F'` and
+ * longer cycles.
+ */
+typedef struct {
+    char *name;
+    char *value;
+    char *text;
+    Token *tokens;
+    int num_tokens;
+    int expanding;
+    unsigned int hash;
+} Alias;
+
+Alias *alias_table = NULL;
+size_t alias_capacity = 0;
+size_t num_aliases = 0;
+
+/* alias_slot: the slot holding name, or the empty slot where it would go. */
+Alias *alias_slot(Alias *table, size_t capacity, const char *name, size_t len, unsigned int hash) {
+    size_t i = hash & (capacity - 1);
+
+    while (table[i].name != NULL) {
+        if (table[i].hash == hash && strncmp(table[i].name, name, len) == 0 && table[i].name[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return &table[i];
+}
+
+Alias *find_alias(const char *name, size_t len) {
+    if (num_aliases == 0) {
+        return NULL;
+    }
+
+    Alias *alias = alias_slot(alias_table, alias_capacity, name, len, hash_bytes(name, len));
+    return alias->name != NULL ? alias : NULL;
+}
+
+void alias_free_value(Alias *alias) {
+    free(alias->value);
+    free(alias->text);
+    free(alias->tokens);
+}
+
+void define_alias(char *name, char *value) {
+    size_t len = strlen(name);
+    unsigned int hash = hash_bytes(name, len);
+
+    if ((num_aliases + 1) * 2 > alias_capacity) {
+        size_t capacity = alias_capacity ? alias_capacity * 2 : 64;
+        Alias *table = calloc(capacity, sizeof(Alias));
+
+        if (table == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < alias_capacity; i++) {
+            if (alias_table[i].name != NULL) {
+                *alias_slot(table, capacity, alias_table[i].name, strlen(alias_table[i].name), alias_table[i].hash) = alias_table[i];
+            }
+        }
+
+        free(alias_table);
+        alias_table = table;
+        alias_capacity = capacity;
+    }
+
+    Alias *alias = alias_slot(alias_table, alias_capacity, name, len, hash);
+
+    if (alias->name != NULL) {
+        alias_free_value(alias);
+    }
+
+    else {
+        alias->name = strdup(name);
+        alias->hash = hash;
+        num_aliases++;
+    }
+
+    size_t value_len = strlen(value);
+
+    alias->value = strdup(value);
+    alias->text = strdup(value);
+    alias->tokens = malloc((value_len + 1) * sizeof(Token));
+    alias->expanding = 0;
+    if (alias->name == NULL || alias->value == NULL || alias->text == NULL || alias->tokens == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A value that does not lex is reported each time it is used, like a bad line. */
+    syntax_quiet = 1;
+    alias->num_tokens = lex_line(alias->text, alias->tokens, value_len + 1);
+    syntax_quiet = 0;
+}
+
+int compare_alias_names(const void *a, const void *b) {
+    return strcmp((*(Alias * const *)a)->name, (*(Alias * const *)b)->name);
+}
+
+void list_aliases() {
+    Alias **sorted = malloc((num_aliases + 1) * sizeof(Alias *));
+    size_t count = 0;
+
+    if (sorted == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    for (size_t i = 0; i < alias_capacity; i++) {
+        if (alias_table[i].name != NULL) {
+            sorted[count++] = &alias_table[i];
+        }
+    }
+
+    qsort(sorted, count, sizeof(Alias *), compare_alias_names);
+    for (size_t i = 0; i < count; i++) {
+        printf("%s='%s'\n", sorted[i]->name, sorted[i]->value);
+    }
+
+    free(sorted);
+}
+
+int print_aliases(char *name) {
+    Alias *alias = find_alias(name, strlen(name));
+
+    if (alias == NULL) {
+        fprintf(stderr, "alias: %s: not found\n", name);
+        return 1;
+    }
+
+    printf("%s='%s'\n", alias->name, alias->value);
+    return 0;
+}
+
+void alias_clear(void) {
+    for (size_t i = 0; i < alias_capacity; i++) {
+        if (alias_table[i].name != NULL) {
+            free(alias_table[i].name);
+            alias_free_value(&alias_table[i]);
+        }
+    }
+
+    free(alias_table);
+    alias_table = NULL;
+    alias_capacity = 0;
+    num_aliases = 0;
+}
+
+typedef struct {
+    Token *tokens;
+    int num_tokens;
+    int capacity;
+    int command_position;
+} AliasExpansion;
+
+/* The alias a token names if it is an unquoted word in command position. */
+Alias *alias_at(Token *token, int command_position) {
+    if (!command_position || token->type != TOKEN_WORD || token->quoted) {
+        return NULL;
+    }
+
+    return find_alias(token->start, token->length);
+}
+
+/* Whether the token after this one is in command position. */
+int next_command_position(Token *token, int command_position) {
+    if (token->type != TOKEN_WORD) {
+        return token->type != TOKEN_RPAREN;
+    }
+
+    return command_position && token->length == 1 && *token->start == '{' && !token->quoted;
+}
+
+int alias_emit(AliasExpansion *x, Token *tokens, int num_tokens, int from_alias) {
+    for (int i = 0; i < num_tokens; i++) {
+        Alias *alias = alias_at(&tokens[i], x->command_position);
+
+        if (alias != NULL && !alias->expanding) {
+            if (alias->num_tokens == -1) {
+                size_t value_len = strlen(alias->value);
+                char *copy = arena_strndup(&line_arena, alias->value, value_len);
+
+                lex_line(copy, arena_alloc(&line_arena, (value_len + 1) * sizeof(Token)), value_len + 1);
+                return -1;
+            }
+
+            alias->expanding = 1;
+            int status = alias_emit(x, alias->tokens, alias->num_tokens, 1);
+            alias->expanding = 0;
+            if (status == -1) {
+                return -1;
+            }
+
+            /* A trailing blank in the value lets the next word be an alias too. */
+            size_t value_len = strlen(alias->value);
+            x->command_position = value_len > 0 && (alias->value[value_len - 1] == ' ' || alias->value[value_len - 1] == '\t');
+            continue;
+        }
+
+        if (x->num_tokens == x->capacity) {
+            Token *grown = arena_alloc(&line_arena, x->capacity * 2 * sizeof(Token));
+
+            memcpy(grown, x->tokens, x->num_tokens * sizeof(Token));
+            x->tokens = grown;
+            x->capacity *= 2;
+        }
+
+        Token *token = &x->tokens[x->num_tokens++];
+
+        *token = tokens[i];
+        /* Dequoting works in place, so quoted alias words get a copy of their own. */
+        if (from_alias && token->quoted) {
+            token->start = arena_strndup(&line_arena, token->start, token->length);
+        }
+        x->command_position = next_command_position(token, x->command_position);
+    }
+
+    return 0;
+}
+
+/*
+ * expand_aliases: rewrite *tokens with every alias in command position
+ * replaced by its tokens. Returns the new count, or -1 after reporting a
+ * syntax error in an alias value.
+ */
+int expand_aliases(Token **tokens, int num_tokens) {
+    AliasExpansion x;
+    int needed = 0;
+
+    for (int i = 0, position = 1; i < num_tokens && !needed; i++) {
+        needed = alias_at(&(*tokens)[i], position) != NULL;
+        position = next_command_position(&(*tokens)[i], position);
+    }
+
+    if (!needed) {
+        return num_tokens;
+    }
+
+    x.capacity = num_tokens * 2 + 16;
+    x.tokens = arena_alloc(&line_arena, x.capacity * sizeof(Token));
+    x.num_tokens = 0;
+    x.command_position = 1;
+
+    if (alias_emit(&x, *tokens, num_tokens, 0) == -1) {
+        return -1;
+    }
+
+    *tokens = x.tokens;
+    return x.num_tokens;
+}
+
+/*
+ * Background jobs. SIGCHLD only writes a byte to a non-blocking self-pipe;
+ * the shell drains it between commands and reaps finished job processes
+ * with WNOHANG, so no zombie outlives the next prompt. `wait` blocks on the
+ * same pipe instead of polling.
+ */
+typedef struct {
+    int id;
+    pid_t pids[MAX_PIPELINE];
+    int statuses[MAX_PIPELINE];
+    int num_pids;
+    int running;
+    char *command;
+} Job;
+
+Job *job_table = NULL;
+int num_jobs = 0;
+int jobs_capacity = 0;
+int sigchld_pipe[2] = {-1, -1};
+pid_t last_background_pid = 0;
+
+void sigchld_handler(int sig) {
+    int saved_errno = errno;
+    char byte = 0;
+
+    (void)sig;
+    if (write(sigchld_pipe[1], &byte, 1) == -1) {
+        /* Pipe already full: a wakeup is pending anyway. */
+    }
+
+    errno = saved_errno;
+}
+
+void jobs_init(void) {
+    struct sigaction sa;
+
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+Job *add_job(const char *command) {
+    int id = 1;
+
+    for (int i = 0; i < num_jobs; i++) {
+        if (job_table[i].id >= id) {
+            id = job_table[i].id + 1;
+        }
+    }
+
+    if (num_jobs == jobs_capacity) {
+        jobs_capacity = jobs_capacity ? jobs_capacity * 2 : 16;
+        job_table = realloc(job_table, jobs_capacity * sizeof(Job));
+        if (job_table == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Job *job = &job_table[num_jobs++];
+    job->id = id;
+    job->num_pids = 0;
+    job->running = 0;
+    job->command = strdup(command);
+
+    return job;
+}
+
+void remove_job(Job *job) {
+    free(job->command);
+    *job = job_table[--num_jobs];
+}
+
+Job *find_job(const char *spec) {
+    if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+
+        for (int i = 0; i < num_jobs; i++) {
+            if (job_table[i].id == id) {
+                return &job_table[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    pid_t pid = atoi(spec);
+    for (int i = 0; i < num_jobs; i++) {
+        for (int j = 0; j < job_table[i].num_pids; j++) {
+            if (job_table[i].pids[j] == pid) {
+                return &job_table[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int job_status(Job *job) {
+    return job->num_pids > 0 ? job->statuses[job->num_pids - 1] : 0;
+}
+
+/* reap_jobs: collect every finished job process; with notify, report and drop done jobs. */
+void reap_jobs(int notify) {
+    char buffer[64];
+
+    if (sigchld_pipe[0] == -1) {
+        return;
+    }
+
+    while (read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0) {
+        ;
+    }
+
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = &job_table[i];
+
+        for (int j = 0; job->running > 0 && j < job->num_pids; j++) {
+            int wstatus;
+
+            if (job->pids[j] != -1 && waitpid(job->pids[j], &wstatus, WNOHANG) == job->pids[j]) {
+                job->statuses[j] = wait_status(wstatus);
+                job->pids[j] = -1;
+                job->running--;
+            }
+        }
+    }
+
+    /* As a subreaper we also inherit whatever the commands orphan; collect it too. */
+    if (zygote_fd != -1) {
+        int wstatus;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+            for (int i = 0; i < num_jobs; i++) {
+                for (int j = 0; j < job_table[i].num_pids; j++) {
+                    if (job_table[i].pids[j] == pid) {
+                        job_table[i].statuses[j] = wait_status(wstatus);
+                        job_table[i].pids[j] = -1;
+                        job_table[i].running--;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int i = 0; notify && i < num_jobs; i++) {
+        if (job_table[i].running == 0) {
+            printf("[%d]  Done(%d)\t%s\n", job_table[i].id, job_status(&job_table[i]), job_table[i].command);
+            remove_job(&job_table[i]);
+            i--;
+        }
+    }
+}
+
+/* Sleeps until the next SIGCHLD arrives; the byte is left for reap_jobs. */
+void wait_for_sigchld(void) {
+    struct pollfd pfd;
+
+    pfd.fd = sigchld_pipe[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+}
+
+int builtin_jobs(char **args) {
+    (void)args;
+    reap_jobs(0);
+
+    for (int i = 0; i < num_jobs; i++) {
+        Job *job = &job_table[i];
+
+        if (job->running > 0) {
+            printf("[%d]  Running\t%s &\n", job->id, job->command);
+        }
+
+        else {
+            printf("[%d]  Done(%d)\t%s\n", job->id, job_status(job), job->command);
+            remove_job(job);
+            i--;
+        }
+    }
+
+    return 0;
+}
+
+/* wait: every job, the given %id/pid jobs, or (-n) whichever job finishes next. */
+int builtin_wait(char **args) {
+    int status = 0;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        if (num_jobs == 0) {
+            return 127;
+        }
+
+        while (1) {
+            reap_jobs(0);
+
+            for (int i = 0; i < num_jobs; i++) {
+                if (job_table[i].running == 0) {
+                    status = job_status(&job_table[i]);
+                    remove_job(&job_table[i]);
+                    return status;
+                }
+            }
+
+            wait_for_sigchld();
+        }
+    }
+
+    if (args[1] == NULL) {
+        while (1) {
+            reap_jobs(0);
+
+            int running = 0;
+            for (int i = 0; i < num_jobs; i++) {
+                running += job_table[i].running;
+            }
+
+            if (running == 0) {
+                break;
+            }
+
+            wait_for_sigchld();
+        }
+
+        while (num_jobs > 0) {
+            remove_job(&job_table[0]);
+        }
+
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        Job *job = find_job(args[i]);
+
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+
+        int id = job->id;
+        while (1) {
+            reap_jobs(0);
+
+            /* reap_jobs never removes entries, but the table may have moved. */
+            for (job = job_table; job->id != id; job++) {
+                ;
+            }
+
+            if (job->running == 0) {
+                break;
+            }
+
+            wait_for_sigchld();
+        }
+
+        status = job_status(job);
+        remove_job(job);
+    }
+
+    return status;
+}
+
+/*
+ * Utility builtins. echo, printf, pwd, true, false and test/[ run in the
+ * shell and write through stdout, so they follow any redirection or pipe
+ * capture and never cost a fork.
+ */
+
+/*
+ * print_escaped: write str expanding backslash escapes (\n, \t, \\, \0nnn,
+ * ...). Returns 1 if a \c asked for all further output to stop.
+ */
+int print_escaped(const char *str) {
+    for (const char *p = str; *p != '\0'; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            putchar(*p);
+            continue;
+        }
+
+        switch (*++p) {
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'c': return 1;
+            case 'e': putchar('\033'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '\\': putchar('\\'); break;
+
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7': {
+                int value = 0;
+                int digits = *p == '0' ? 4 : 3;
+
+                for (int i = 0; i < digits && *p >= '0' && *p <= '7'; i++, p++) {
+                    value = value * 8 + (*p - '0');
+                }
+                p--;
+                putchar(value & 0xff);
+                break;
+            }
+
+            default:
+                putchar('\\');
+                putchar(*p);
+        }
+    }
+
+    return 0;
+}
+
+/* echo [-neE] args: -n drops the newline, -e expands escapes, -E (default) does not. */
+int builtin_echo(char **args) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) {
+            break;
+        }
+
+        for (char *flag = args[i] + 1; *flag != '\0'; flag++) {
+            newline = *flag == 'n' ? 0 : newline;
+            escapes = *flag == 'e' ? 1 : *flag == 'E' ? 0 : escapes;
+        }
+    }
+
+    for (; args[i] != NULL; i++) {
+        if (escapes && print_escaped(args[i])) {
+            return 0;
+        }
+
+        else if (!escapes) {
+            fputs(args[i], stdout);
+        }
+
+        if (args[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+
+    if (newline) {
+        putchar('\n');
+    }
+
+    return 0;
+}
+
+/* printf numeric arguments may also be 'c or "c, meaning the character's code. */
+int printf_number(const char *arg, long long *value) {
+    char *end;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return 0;
+    }
+
+    errno = 0;
+    *value = strtoll(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        return 1;
+    }
+
+    return 0;
+}
+
+int builtin_printf(char **args) {
+    int argc = 0;
+    int status = 0;
+
+    while (args[argc] != NULL) {
+        argc++;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: printf FORMAT [ARGUMENT...]\n");
+        return 2;
+    }
+
+    const char *format = args[1];
+    int next = 2;
+
+    /* The format is reused until every argument has been consumed. */
+    do {
+        int first = next;
+
+        for (const char *p = format; *p != '\0'; p++) {
+            if (*p == '\\') {
+                char escape[5] = {'\\', 0, 0, 0, 0};
+                int len = 1;
+
+                escape[len++] = *++p;
+                while (len < 4 && escape[1] >= '0' && escape[1] <= '7' && p[1] >= '0' && p[1] <= '7') {
+                    escape[len++] = *++p;
+                }
+                if (escape[1] == '\0') {
+                    p--;
+                }
+
+                if (print_escaped(escape)) {
+                    return status;
+                }
+                continue;
+            }
+
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            char spec[64];
+            size_t len = 0;
+            int star[2] = {0, 0};
+            int num_stars = 0;
+
+            spec[len++] = *p++;
+            while (*p != '\0' && strchr("-+ #0123456789.*", *p) != NULL && len < sizeof(spec) - 4) {
+                if (*p == '*' && num_stars < 2) {
+                    long long value = 0;
+
+                    if (next < argc) {
+                        status |= printf_number(args[next++], &value);
+                    }
+                    star[num_stars++] = (int)value;
+                }
+                spec[len++] = *p++;
+            }
+
+            char conversion = *p;
+            const char *arg = next < argc ? args[next++] : NULL;
+
+            if (conversion == '\0') {
+                fprintf(stderr, "printf: missing format character\n");
+                return 1;
+            }
+
+            if (strchr("diouxXc", conversion) != NULL) {
+                long long value = 0;
+
+                if (conversion == 'c') {
+                    value = arg != NULL ? (unsigned char)arg[0] : 0;
+                }
+
+                else if (arg != NULL) {
+                    status |= printf_number(arg, &value);
+                }
+
+                if (conversion != 'c') {
+                    spec[len++] = 'l';
+                    spec[len++] = 'l';
+                }
+                spec[len++] = conversion;
+                spec[len] = '\0';
+
+                if (num_stars == 2) {
+                    printf(spec, star[0], star[1], value);
+                }
+
+                else if (num_stars == 1) {
+                    printf(spec, star[0], value);
+                }
+
+                else if (conversion == 'c') {
+                    printf(spec, (int)value);
+                }
+
+                else {
+                    printf(spec, value);
+                }
+            }
+
+            else if (strchr("eEfFgGaA", conversion) != NULL) {
+                double value = arg != NULL ? strtod(arg, NULL) : 0.0;
+
+                spec[len++] = conversion;
+                spec[len] = '\0';
+
+                if (num_stars == 2) {
+                    printf(spec, star[0], star[1], value);
+                }
+
+                else if (num_stars == 1) {
+                    printf(spec, star[0], value);
+                }
+
+                else {
+                    printf(spec, value);
+                }
+            }
+
+            else if (conversion == 's' || conversion == 'b') {
+                spec[len++] = 's';
+                spec[len] = '\0';
+
+                if (conversion == 'b' && arg != NULL && len == 2) {
+                    if (print_escaped(arg)) {
+                        return status;
+                    }
+                }
+
+                else if (num_stars == 2) {
+                    printf(spec, star[0], star[1], arg != NULL ? arg : "");
+                }
+
+                else if (num_stars == 1) {
+                    printf(spec, star[0], arg != NULL ? arg : "");
+                }
+
+                else {
+                    printf(spec, arg != NULL ? arg : "");
+                }
+            }
+
+            else {
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conversion);
+                return 1;
+            }
+        }
+
+        if (next == first) {
+            break;
+        }
+    } while (next < argc);
+
+    return status;
+}
+
+/*
+ * Logical working directory: shell_pwd caches the directory as cd -L named
+ * it (symlinks kept, "." and ".." folded textually), together with the
+ * dev/inode it resolved to. The prompt, pwd and relative cd use it as is
+ * after a single stat; getcwd only runs when there is no cache yet or the
+ * cached path no longer leads to the same directory.
+ */
+char *shell_pwd = NULL;
+dev_t shell_pwd_dev;
+ino_t shell_pwd_ino;
+
+/* pwd_set: cache path as the logical cwd and export it as PWD. */
+void pwd_set(const char *path) {
+    struct stat st;
+    char *copy = strdup(path);
+
+    if (copy == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    free(shell_pwd);
+    shell_pwd = copy;
+    if (stat(shell_pwd, &st) == 0) {
+        shell_pwd_dev = st.st_dev;
+        shell_pwd_ino = st.st_ino;
+    }
+
+    var_set("PWD", 3, shell_pwd, VAR_EXPORT);
+}
+
+/* pwd_physical: reset the cache from getcwd. Returns NULL if the cwd has no path any more. */
+const char *pwd_physical(void) {
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return NULL;
+    }
+
+    pwd_set(cwd);
+    return shell_pwd;
+}
+
+/* pwd_get: the logical cwd, adopting an inherited $PWD on first use when it names ".". */
+const char *pwd_get(void) {
+    struct stat st, current;
+
+    if (shell_pwd == NULL) {
+        const char *pwd = var_get("PWD");
+
+        if (pwd != NULL && pwd[0] == '/' && stat(pwd, &st) == 0 && stat(".", &current) == 0
+            && st.st_dev == current.st_dev && st.st_ino == current.st_ino) {
+            pwd_set(pwd);
+            return shell_pwd;
+        }
+
+        return pwd_physical();
+    }
+
+    if (stat(shell_pwd, &st) != 0 || st.st_dev != shell_pwd_dev || st.st_ino != shell_pwd_ino) {
+        return pwd_physical();
+    }
+
+    return shell_pwd;
+}
+
+/* pwd_logical: dir made absolute against the logical cwd, with "." and ".." folded textually. */
+char *pwd_logical(const char *dir) {
+    const char *base = dir[0] == '/' ? "" : pwd_get();
+
+    if (base == NULL) {
+        return NULL;
+    }
+
+    size_t base_len = strlen(base);
+    char *path = malloc(base_len + strlen(dir) + 3);
+    size_t len = 0;
+
+    if (path == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Components of base are already clean, so only dir's need folding. */
+    memcpy(path, base, base_len);
+    len = base_len == 1 ? 0 : base_len;
+    for (const char *p = dir; *p != '\0'; ) {
+        const char *end = strchrnul(p, '/');
+        size_t comp_len = end - p;
+
+        if (comp_len == 2 && p[0] == '.' && p[1] == '.') {
+            while (len > 0 && path[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        }
+
+        else if (comp_len > 0 && !(comp_len == 1 && p[0] == '.')) {
+            path[len++] = '/';
+            memcpy(path + len, p, comp_len);
+            len += comp_len;
+        }
+
+        p = *end == '/' ? end + 1 : end;
+    }
+
+    if (len == 0) {
+        path[len++] = '/';
+    }
+    path[len] = '\0';
+
+    return path;
+}
+
+/* pwd [-L|-P]: -L (default) prints the logical cwd, -P resolves it with getcwd. */
+int builtin_pwd(char **args) {
+    char physical[PATH_MAX];
+    const char *cwd;
+
+    if (args[1] != NULL && strcmp(args[1], "-P") == 0) {
+        cwd = getcwd(physical, sizeof(physical));
+    }
+
+    else {
+        cwd = pwd_get();
+    }
+
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+
+    printf("%s\n", cwd);
+    return 0;
+}
+
+/*
+ * test / [: the POSIX rules by argument count for up to four arguments,
+ * and a recursive descent over !, -a, -o and parentheses beyond that.
+ */
+typedef struct {
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+} TestParser;
+
+int test_integer(TestParser *parser, const char *arg, long long *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtoll(arg, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+
+    if (*arg == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        parser->error = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+int is_test_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghLnprsStuwxzGO", op[1]) != NULL;
+}
+
+int is_test_binary(const char *op) {
+    const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int test_unary(TestParser *parser, const char *op, const char *arg) {
+    struct stat st;
+
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': {
+            long long fd;
+            return test_integer(parser, arg, &fd) && isatty((int)fd);
+        }
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
+
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+
+    switch (op[1]) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'G': return st.st_gid == getegid();
+        case 'O': return st.st_uid == geteuid();
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+
+    return 0;
+}
+
+int test_binary(TestParser *parser, const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    }
+
+    else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    }
+
+    else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    }
+
+    else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    }
+
+    else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        int has_a = stat(left, &a) == 0;
+        int has_b = stat(right, &b) == 0;
+
+        if (op[1] == 'e') {
+            return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+
+        if (op[1] == 'o') {
+            struct stat swap = a;
+            int has_swap = has_a;
+
+            a = b;
+            has_a = has_b;
+            b = swap;
+            has_b = has_swap;
+        }
+
+        if (!has_a) {
+            return 0;
+        }
+
+        return !has_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec
+            || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+
+    long long a, b;
+    if (!test_integer(parser, left, &a) || !test_integer(parser, right, &b)) {
+        return 0;
+    }
+
+    switch (op[1] * 256 + op[2]) {
+        case 'e' * 256 + 'q': return a == b;
+        case 'n' * 256 + 'e': return a != b;
+        case 'l' * 256 + 't': return a < b;
+        case 'l' * 256 + 'e': return a <= b;
+        case 'g' * 256 + 't': return a > b;
+        default: return a >= b;
+    }
+}
+
+int test_or(TestParser *parser);
+
+int test_primary(TestParser *parser) {
+    char **argv = parser->argv;
+    int remaining = parser->argc - parser->pos;
+
+    if (remaining <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = 1;
+        return 0;
+    }
+
+    if (strcmp(argv[parser->pos], "!") == 0) {
+        parser->pos++;
+        return !test_primary(parser);
+    }
+
+    if (strcmp(argv[parser->pos], "(") == 0) {
+        parser->pos++;
+        int result = test_or(parser);
+
+        if (parser->pos >= parser->argc || strcmp(argv[parser->pos], ")") != 0) {
+            fprintf(stderr, "test: ')' expected\n");
+            parser->error = 1;
+            return 0;
+        }
+        parser->pos++;
+        return result;
+    }
+
+    if (remaining >= 3 && is_test_binary(argv[parser->pos + 1])) {
+        parser->pos += 3;
+        return test_binary(parser, argv[parser->pos - 3], argv[parser->pos - 2], argv[parser->pos - 1]);
+    }
+
+    if (remaining >= 2 && is_test_unary(argv[parser->pos])) {
+        parser->pos += 2;
+        return test_unary(parser, argv[parser->pos - 2], argv[parser->pos - 1]);
+    }
+
+    return argv[parser->pos++][0] != '\0';
+}
+
+int test_and(TestParser *parser) {
+    int result = test_primary(parser);
+
+    while (parser->pos < parser->argc && strcmp(parser->argv[parser->pos], "-a") == 0) {
+        parser->pos++;
+        result = test_primary(parser) && result;
+    }
+
+    return result;
+}
+
+int test_or(TestParser *parser) {
+    int result = test_and(parser);
+
+    while (parser->pos < parser->argc && strcmp(parser->argv[parser->pos], "-o") == 0) {
+        parser->pos++;
+        result = test_and(parser) || result;
+    }
+
+    return result;
+}
+
+/* test_count: the POSIX table for argc <= 4; anything else goes to the full grammar. */
+int test_count(TestParser *parser, char **argv, int argc) {
+    if (argc == 0) {
+        return 0;
+    }
+
+    if (argc == 1) {
+        return argv[0][0] != '\0';
+    }
+
+    if (argc == 2 && strcmp(argv[0], "!") == 0) {
+        return !test_count(parser, argv + 1, 1);
+    }
+
+    if (argc == 2 && is_test_unary(argv[0])) {
+        return test_unary(parser, argv[0], argv[1]);
+    }
+
+    if (argc == 3 && is_test_binary(argv[1])) {
+        return test_binary(parser, argv[0], argv[1], argv[2]);
+    }
+
+    if (argc == 3 && strcmp(argv[0], "!") == 0) {
+        return !test_count(parser, argv + 1, 2);
+    }
+
+    if (argc == 3 && strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) {
+        return test_count(parser, argv + 1, 1);
+    }
+
+    if (argc == 4 && strcmp(argv[0], "!") == 0) {
+        return !test_count(parser, argv + 1, 3);
+    }
+
+    if (argc == 4 && strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) {
+        return test_count(parser, argv + 1, 2);
+    }
+
+    parser->argv = argv;
+    parser->argc = argc;
+    parser->pos = 0;
+
+    int result = test_or(parser);
+    if (!parser->error && parser->pos != argc) {
+        fprintf(stderr, "test: %s: unexpected argument\n", argv[parser->pos]);
+        parser->error = 1;
+    }
+
+    return result;
+}
+
+int builtin_test(char **args) {
+    TestParser parser = {NULL, 0, 0, 0};
+    int argc = 0;
+
+    while (args[argc] != NULL) {
+        argc++;
+    }
+
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    int result = test_count(&parser, args + 1, argc - 1);
+
+    return parser.error ? 2 : !result;
+}
+
+int builtin_parallel(char **args);
+int builtin_command(char **args);
+int builtin_builtin(char **args);
+int builtin_enable(char **args);
+int builtin_source(char **args);
+int builtin_let(char **args);
+
+int builtin_exit(char **args) {
+    int exit_status = 0;
+    if (args[1] != NULL) {
+        exit_status = atoi(args[1]);
+    }
+    printf("Exiting simple_shell with status %d.\n", exit_status);
+    exit(exit_status);
+}
+
+int builtin_setenv(char **args) {
+    int status = 1;
+
+    if (args[1] != NULL && args[2] != NULL) {
+        if (*args[1] == '\0' || strchr(args[1], '=') != NULL) {
+            fprintf(stderr, "Failed to set environment variable %s\n", args[1]);
+        }
+
+        else {
+            var_set(args[1], strlen(args[1]), args[2], VAR_EXPORT);
+            status = 0;
+        }
+    }
+
+    else {
+        fprintf(stderr, "Usage: setenv VARIABLE VALUE\n");
+    }
+
+    return status;
+}
+
+int builtin_unsetenv(char **args) {
+    int status = 1;
+
+    if (args[1] != NULL) {
+        if (*args[1] == '\0' || strchr(args[1], '=') != NULL) {
+            fprintf(stderr, "Failed to unset environment variable %s\n", args[1]);
+        }
+
+        else {
+            var_unset(args[1]);
+            status = 0;
+        }
+    }
+
+    else {
+        fprintf(stderr, "Usage: unsetenv VARIABLE\n");
+    }
+
+    return status;
+}
+
+/* export [NAME[=value]...]: mark variables for the environment of commands; alone, list them. */
+int builtin_export(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        for (char **env = var_environ(); *env != NULL; env++) {
+            printf("export %s\n", *env);
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t len = is_assignment(args[i]);
+
+        if (len > 0) {
+            var_set(args[i], len, args[i] + len + 1, VAR_EXPORT);
+        }
+
+        else if (*args[i] != '\0' && name_length(args[i]) == strlen(args[i])) {
+            var_export(args[i], strlen(args[i]));
+        }
+
+        else {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+int builtin_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        var_unset(args[i]);
+    }
+
+    return 0;
+}
+
+/* env [command args]: print the exported variables, or run command (through env(1)). */
+int builtin_env(char **args) {
+    if (args[1] != NULL) {
+        return execute_command(args[0], args, NULL);
+    }
+
+    for (char **env = var_environ(); *env != NULL; env++) {
+        printf("%s\n", *env);
+    }
+
+    return 0;
+}
+
+/*
+ * cd [-L|-P] [dir|-]: -L (default) moves to dir taken relative to the
+ * logical cwd with ".." removing the last component, falling back to the
+ * physical path if that fails; -P follows the physical path and records
+ * what getcwd makes of it. OLDPWD is set on every successful cd.
+ */
+int builtin_cd(char **args) {
+    int physical = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && (strcmp(args[i], "-L") == 0 || strcmp(args[i], "-P") == 0); i++) {
+        physical = args[i][1] == 'P';
+    }
+
+    const char *dir = args[i];
+    int print = 0;
+
+    if (dir == NULL || strcmp(dir, "~") == 0) {
+        dir = var_get("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    }
+
+    else if (strcmp(dir, "-") == 0) {
+        dir = var_get("OLDPWD");
+        if (dir == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        print = 1;
+    }
+
+    const char *current = pwd_get();
+    char *old = current != NULL ? strdup(current) : NULL;
+    char *logical = physical ? NULL : pwd_logical(dir);
+    int status = 0;
+
+    if (logical != NULL && chdir(logical) == 0) {
+        pwd_set(logical);
+    }
+
+    else if (chdir(dir) == 0) {
+        pwd_physical();
+    }
+
+    else {
+        perror("chdir");
+        status = 1;
+    }
+
+    if (status == 0) {
+        zygote_cwd_changed();
+        if (old != NULL) {
+            var_set("OLDPWD", 6, old, VAR_EXPORT);
+        }
+        if (print && shell_pwd != NULL) {
+            printf("%s\n", shell_pwd);
+        }
+    }
+
+    free(logical);
+    free(old);
+    return status;
+}
+
+int builtin_alias(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        list_aliases();
+    }
+
+    for (int j = 1; args[j] != NULL; j++) {
+        char *value = strchr(args[j], '=');
+
+        if (value == NULL) {
+            status |= print_aliases(args[j]);
+            continue;
+        }
+
+        *value = '\0';
+        define_alias(args[j], value + 1);
+        *value = '=';
+    }
+
+    return status;
+}
+
+int builtin_true(char **args) {
+    (void)args;
+    return 0;
+}
+
+int builtin_false(char **args) {
+    (void)args;
+    return 1;
+}
+
+/*
+ * Builtin registry. Every builtin is one row of builtin_list; adding a row
+ * is all it takes to add a builtin. Lookups go through an open-addressed
+ * table indexed by a multiplicative hash whose constant
+ * (BUILTIN_HASH_SEED) was chosen so the rows below land in distinct slots,
+ * so dispatch is one hash and one strcmp. Builtins registered later, or
+ * rows added without re-tuning the constant, still work through linear
+ * probing.
+ */
+typedef struct {
+    const char *name;
+    int (*fn)(char **args);
+    int flags;
+    LoadableBuiltin *loadable;
+} Builtin;
+
+Builtin builtin_list[] = {
+    {"exit", builtin_exit, BUILTIN_STATE, NULL},
+    {"setenv", builtin_setenv, BUILTIN_STATE, NULL},
+    {"unsetenv", builtin_unsetenv, BUILTIN_STATE, NULL},
+    {"export", builtin_export, BUILTIN_STATE, NULL},
+    {"unset", builtin_unset, BUILTIN_STATE, NULL},
+    {"let", builtin_let, BUILTIN_STATE, NULL},
+    {"env", builtin_env, BUILTIN_OUTPUT, NULL},
+    {"cd", builtin_cd, BUILTIN_STATE, NULL},
+    {"wait", builtin_wait, BUILTIN_STATE, NULL},
+    {"alias", builtin_alias, BUILTIN_OUTPUT, NULL},
+    {"hash", builtin_hash, BUILTIN_OUTPUT, NULL},
+    {"jobs", builtin_jobs, BUILTIN_OUTPUT, NULL},
+    {"parallel", builtin_parallel, BUILTIN_OUTPUT, NULL},
+    {"echo", builtin_echo, BUILTIN_OUTPUT, NULL},
+    {"printf", builtin_printf, BUILTIN_OUTPUT, NULL},
+    {"pwd", builtin_pwd, BUILTIN_OUTPUT, NULL},
+    {"true", builtin_true, BUILTIN_OUTPUT, NULL},
+    {"false", builtin_false, BUILTIN_OUTPUT, NULL},
+    {"test", builtin_test, BUILTIN_OUTPUT, NULL},
+    {"[", builtin_test, BUILTIN_OUTPUT, NULL},
+    {"command", builtin_command, BUILTIN_OUTPUT, NULL},
+    {"builtin", builtin_builtin, BUILTIN_OUTPUT, NULL},
+    {"enable", builtin_enable, BUILTIN_STATE, NULL},
+    {"source", builtin_source, BUILTIN_STATE, NULL},
+    {".", builtin_source, BUILTIN_STATE, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+Builtin *builtin_table[BUILTIN_TABLE_SIZE];
+int num_builtins = 0;
+
+unsigned int builtin_slot(const char *name) {
+    return (hash_string(name) * BUILTIN_HASH_SEED) >> (32 - BUILTIN_TABLE_BITS);
+}
+
+/* register_builtin: add (or replace) a builtin; returns -1 when the table is full. */
+int register_builtin(Builtin *builtin) {
+    unsigned int slot = builtin_slot(builtin->name);
+
+    for (int i = 0; i < BUILTIN_TABLE_SIZE; i++, slot = (slot + 1) % BUILTIN_TABLE_SIZE) {
+        if (builtin_table[slot] == NULL || strcmp(builtin_table[slot]->name, builtin->name) == 0) {
+            num_builtins += builtin_table[slot] == NULL;
+            builtin_table[slot] = builtin;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void builtins_init(void) {
+    if (num_builtins == 0) {
+        for (int i = 0; builtin_list[i].name != NULL; i++) {
+            register_builtin(&builtin_list[i]);
+        }
+    }
+}
+
+Builtin *find_builtin(const char *name) {
+    builtins_init();
+
+    unsigned int slot = builtin_slot(name);
+
+    for (int i = 0; i < BUILTIN_TABLE_SIZE && builtin_table[slot] != NULL; i++, slot = (slot + 1) % BUILTIN_TABLE_SIZE) {
+        if (strcmp(builtin_table[slot]->name, name) == 0) {
+            return builtin_table[slot];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Loadable builtins: `enable -f lib.so name...` dlopens lib.so and registers
+ * each name from its exported <name>_builtin (see loadable_builtin.h), so
+ * the command runs in-process through the same registry lookup as every
+ * other builtin. `enable -d name` unloads it again; `enable` lists all.
+ */
+typedef struct LoadedBuiltin {
+    Builtin builtin;
+    void *handle;
+    struct LoadedBuiltin *next;
+} LoadedBuiltin;
+
+LoadedBuiltin *loaded_builtins = NULL;
+
+/* Adapter between the registry's args vector and the loadable ABI. */
+int run_loadable_builtin(LoadableBuiltin *loadable, char **args) {
+    int argc = 0;
+
+    while (args[argc] != NULL) {
+        argc++;
+    }
+
+    fflush(stdout);
+    int status = loadable->run(argc, args, var_environ(), STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    fflush(stdout);
+
+    return status;
+}
+
+void rebuild_builtin_table(void) {
+    memset(builtin_table, 0, sizeof(builtin_table));
+    num_builtins = 0;
+
+    for (int i = 0; builtin_list[i].name != NULL; i++) {
+        register_builtin(&builtin_list[i]);
+    }
+
+    for (LoadedBuiltin *loaded = loaded_builtins; loaded != NULL; loaded = loaded->next) {
+        register_builtin(&loaded->builtin);
+    }
+}
+
+int load_builtin(const char *library, const char *name) {
+    char symbol[256];
+    void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+
+    if (handle == NULL) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 1;
+    }
+
+    snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+    LoadableBuiltin *loadable = dlsym(handle, symbol);
+
+    if (loadable == NULL || loadable->abi_version != LOADABLE_BUILTIN_ABI || loadable->run == NULL) {
+        fprintf(stderr, "enable: %s: %s\n", library, loadable == NULL ? "no such builtin" : "incompatible builtin ABI");
+        dlclose(handle);
+        return 1;
+    }
+
+    if (loadable->init != NULL && loadable->init() != 0) {
+        fprintf(stderr, "enable: %s: initialisation failed\n", name);
+        dlclose(handle);
+        return 1;
+    }
+
+    LoadedBuiltin *loaded = calloc(1, sizeof(LoadedBuiltin));
+    if (loaded == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    loaded->builtin.name = strdup(name);
+    loaded->builtin.flags = BUILTIN_OUTPUT;
+    loaded->builtin.loadable = loadable;
+    loaded->handle = handle;
+    loaded->next = loaded_builtins;
+    loaded_builtins = loaded;
+
+    builtins_init();
+    if (register_builtin(&loaded->builtin) == -1) {
+        fprintf(stderr, "enable: %s: too many builtins\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+int unload_builtin(const char *name) {
+    for (LoadedBuiltin **link = &loaded_builtins; *link != NULL; link = &(*link)->next) {
+        LoadedBuiltin *loaded = *link;
+
+        if (strcmp(loaded->builtin.name, name) == 0) {
+            *link = loaded->next;
+            rebuild_builtin_table();
+
+            if (loaded->builtin.loadable->cleanup != NULL) {
+                loaded->builtin.loadable->cleanup();
+            }
+            dlclose(loaded->handle);
+            free((char *)loaded->builtin.name);
+            free(loaded);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "enable: %s: not a dynamically loaded builtin\n", name);
+    return 1;
+}
+
+int builtin_enable(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        builtins_init();
+        for (int i = 0; i < BUILTIN_TABLE_SIZE; i++) {
+            if (builtin_table[i] != NULL) {
+                printf("enable %s\n", builtin_table[i]->name);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-f") == 0) {
+        if (args[2] == NULL || args[3] == NULL) {
+            fprintf(stderr, "Usage: enable -f LIBRARY NAME...\n");
+            return 2;
+        }
+
+        for (int i = 3; args[i] != NULL; i++) {
+            status |= load_builtin(args[2], args[i]);
+        }
+        return status;
+    }
+
+    if (strcmp(args[1], "-d") == 0) {
+        for (int i = 2; args[i] != NULL; i++) {
+            status |= unload_builtin(args[i]);
+        }
+        return status;
+    }
+
+    fprintf(stderr, "Usage: enable [-f LIBRARY NAME...] [-d NAME...]\n");
+    return 2;
+}
+
+/*
+ * execute_builtin: run command in the shell process if it is a builtin.
+ * Returns 1 and stores the builtin's exit status in *status when it was one.
+ */
+int execute_builtin(char *command, char **args, int *status) {
+    Builtin *builtin = find_builtin(command);
+
+    if (builtin == NULL) {
+        return 0;
+    }
+
+    *status = builtin->loadable != NULL ? run_loadable_builtin(builtin->loadable, args) : builtin->fn(args);
+    return 1;
+}
+
+/* is_builtin: BUILTIN_OUTPUT for builtins that only produce output, BUILTIN_STATE for ones that change shell state. */
+int is_builtin(const char *command) {
+    Builtin *builtin = find_builtin(command);
+
+    return builtin != NULL ? builtin->flags : 0;
+}
+
+/*
+ * Parameter expansion: one pass over a word the lexer flagged WORD_EXPAND,
+ * dequoting it the way materialize_word does and substituting $?, $$, $!,
+ * $#, $0-$9, ${N}, $@, $*, $NAME and ${NAME} on the way, into a buffer from
+ * line_arena. Single-quoted text and \$ stay literal. The result is one
+ * word (no field splitting); an unquoted word that expands to nothing is
+ * dropped by build_argv.
+ */
+int last_status = 0;
+int expand_failed = 0;
+int substitution_status = -1;
+pid_t shell_pid = 0;
+char *shell_name = "simple_shell";
+char **positional = NULL;
+int num_positional = 0;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} WordBuffer;
+
+/* word_reserve: room for n more bytes (and a NUL), doubling the buffer as it fills. */
+void word_reserve(WordBuffer *buf, size_t n) {
+    if (buf->len + n + 1 > buf->cap) {
+        size_t cap = (buf->len + n + 1) * 2;
+        char *data = arena_alloc(&line_arena, cap);
+
+        memcpy(data, buf->data, buf->len);
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+void word_append(WordBuffer *buf, const char *s, size_t n) {
+    word_reserve(buf, n);
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+}
+
+void append_parameter(WordBuffer *buf, const char *name, size_t len) {
+    char number[24];
+    const char *value = NULL;
+
+    if (len == 1 && (*name == '@' || *name == '*')) {
+        for (int i = 0; i < num_positional; i++) {
+            if (i > 0) {
+                word_append(buf, " ", 1);
+            }
+            word_append(buf, positional[i], strlen(positional[i]));
+        }
+        return;
+    }
+
+    if (len == 1 && *name == '?') {
+        snprintf(number, sizeof(number), "%d", last_status);
+        value = number;
+    }
+
+    else if (len == 1 && *name == '$') {
+        snprintf(number, sizeof(number), "%d", (int)shell_pid);
+        value = number;
+    }
+
+    else if (len == 1 && *name == '!') {
+        if (last_background_pid != 0) {
+            snprintf(number, sizeof(number), "%d", (int)last_background_pid);
+            value = number;
+        }
+    }
+
+    else if (len == 1 && *name == '#') {
+        snprintf(number, sizeof(number), "%d", num_positional);
+        value = number;
+    }
+
+    else if (isdigit((unsigned char)*name)) {
+        size_t n = 0;
+
+        for (size_t i = 0; i < len && isdigit((unsigned char)name[i]) && n <= (size_t)num_positional; i++) {
+            n = n * 10 + (name[i] - '0');
+        }
+
+        if (n == 0) {
+            value = shell_name;
+        }
+
+        else if (n <= (size_t)num_positional) {
+            value = positional[n - 1];
+        }
+    }
+
+    else {
+        value = var_lookup(name, len);
+    }
+
+    if (value != NULL) {
+        word_append(buf, value, strlen(value));
+    }
+}
+
+int arith_eval(const char *text, size_t len, int64_t *result);
+void command_substitute(WordBuffer *buf, char *text);
+
+/* expand_parameter: in is just past a '$'; append its expansion and return where the word continues. */
+char *expand_parameter(WordBuffer *buf, char *in, char *end) {
+    char *name = in;
+    size_t len;
+
+    if (in + 1 < end && in[0] == '(' && in[1] == '(') {
+        char *close = skip_arith(in + 2);
+        char number[24];
+        int64_t value;
+
+        if (close == NULL || close > end) {
+            word_append(buf, "$", 1);
+            return in;
+        }
+
+        if (arith_eval(in + 2, close - in - 4, &value) == -1) {
+            expand_failed = 1;
+            return close;
+        }
+
+        snprintf(number, sizeof(number), "%lld", (long long)value);
+        word_append(buf, number, strlen(number));
+        return close;
+    }
+
+    if (in < end && in[0] == '(') {
+        char *close = skip_subst(in + 1);
+
+        if (close == NULL || close > end) {
+            word_append(buf, "$", 1);
+            return in;
+        }
+
+        command_substitute(buf, arena_strndup(&line_arena, in + 1, close - in - 2));
+        return close;
+    }
+
+    if (in < end && *in == '{') {
+        char *close = memchr(in + 1, '}', end - in - 1);
+
+        if (close == NULL || close == in + 1) {
+            word_append(buf, "$", 1);
+            return in;
+        }
+
+        append_parameter(buf, in + 1, close - in - 1);
+        return close + 1;
+    }
+
+    if (in < end && *in != '\0' && strchr("?$!#@*0123456789", *in) != NULL) {
+        len = 1;
+    }
+
+    else if (in < end && (isalpha((unsigned char)*in) || *in == '_')) {
+        for (len = 1; name + len < end && (isalnum((unsigned char)name[len]) || name[len] == '_'); len++) {
+            ;
+        }
+    }
+
+    else {
+        word_append(buf, "$", 1);
+        return in;
+    }
+
+    append_parameter(buf, name, len);
+    return name + len;
+}
+
+char *expand_word(Token *token) {
+    char *in = token->start;
+    char *end = token->start + token->length;
+    WordBuffer buf = {arena_alloc(&line_arena, token->length + 1), 0, token->length + 1};
+    int double_quoted = 0;
+
+    while (in < end) {
+        if (*in == '$') {
+            in = expand_parameter(&buf, in + 1, end);
+        }
+
+        /* `command`: a backslash only quotes $, ` and \ inside it. */
+        else if (*in == '`') {
+            char *close = skip_expansion(in);
+            char *text;
+            char *out;
+
+            if (close == NULL || close > end) {
+                word_append(&buf, in++, 1);
+                continue;
+            }
+
+            text = out = arena_alloc(&line_arena, close - in);
+            for (in++; in < close - 1; in++) {
+                if (*in == '\\' && in + 1 < close - 1 && strchr("$`\\", in[1]) != NULL) {
+                    in++;
+                }
+                *out++ = *in;
+            }
+            *out = '\0';
+
+            command_substitute(&buf, text);
+            in = close;
+        }
+
+        else if (double_quoted) {
+            if (*in == '"') {
+                double_quoted = 0;
+                in++;
+            }
+
+            else if (*in == '\\' && in + 1 < end && strchr("$`\"\\\n", in[1]) != NULL) {
+                if (in[1] != '\n') {
+                    word_append(&buf, in + 1, 1);
+                }
+                in += 2;
+            }
+
+            else {
+                word_append(&buf, in++, 1);
+            }
+        }
+
+        else if (*in == '"') {
+            double_quoted = 1;
+            in++;
+        }
+
+        else if (*in == '\'') {
+            char *close = memchr(in + 1, '\'', end - in - 1);
+
+            word_append(&buf, in + 1, close - in - 1);
+            in = close + 1;
+        }
+
+        else if (*in == '\\') {
+            if (in + 1 < end && in[1] != '\n') {
+                word_append(&buf, in + 1, 1);
+            }
+            in += 2;
+        }
+
+        else {
+            word_append(&buf, in++, 1);
+        }
+    }
+
+    buf.data[buf.len] = '\0';
+    token->start = buf.data;
+    token->length = buf.len;
+    token->quoted = 0;
+    return buf.data;
+}
+
+/*
+ * Arithmetic: $(( )) and let, evaluated in the shell over 64-bit integers
+ * with C's operators and precedence: binary operators by precedence
+ * climbing, then ?:, assignment (= += -= ...) and comma; unary - + ! ~ and
+ * pre/post ++ and --. An expression is compiled once into a node array in
+ * which operations on constants are already folded, and kept in a small
+ * direct-mapped cache keyed by its text, so running it again costs only
+ * the evaluation. Names and $parameters are read when evaluated; a value
+ * that is not a number is evaluated as an expression in turn. Overflow
+ * wraps; division by zero is an error.
+ */
+typedef enum {
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_PARAM,
+    ARITH_NEG,
+    ARITH_NOT,
+    ARITH_BITNOT,
+    ARITH_PRE_INC,
+    ARITH_PRE_DEC,
+    ARITH_POST_INC,
+    ARITH_POST_DEC,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_SHL,
+    ARITH_SHR,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+    ARITH_AND,
+    ARITH_XOR,
+    ARITH_OR,
+    ARITH_LAND,
+    ARITH_LOR,
+    ARITH_COND,
+    ARITH_ASSIGN,
+    ARITH_COMMA
+} ArithOp;
+
+typedef struct {
+    ArithOp op;
+    ArithOp assign_op;
+    int64_t value;
+    int name;
+    int name_len;
+    int left;
+    int right;
+    int third;
+} ArithNode;
+
+typedef struct {
+    char *text;
+    size_t len;
+    unsigned int hash;
+    ArithNode *nodes;
+    int root;
+} ArithExpr;
+
+typedef struct {
+    const char *text;
+    const char *p;
+    const char *end;
+    ArithNode *nodes;
+    int num_nodes;
+    int error;
+} ArithParser;
+
+/* Longer operators first, so "<<" is not read as "<". */
+static const struct {
+    const char *text;
+    ArithOp op;
+    int prec;
+} arith_binary[] = {
+    {"||", ARITH_LOR, 1}, {"&&", ARITH_LAND, 2}, {"|", ARITH_OR, 3}, {"^", ARITH_XOR, 4},
+    {"&", ARITH_AND, 5}, {"==", ARITH_EQ, 6}, {"!=", ARITH_NE, 6}, {"<<", ARITH_SHL, 8},
+    {">>", ARITH_SHR, 8}, {"<=", ARITH_LE, 7}, {">=", ARITH_GE, 7}, {"<", ARITH_LT, 7},
+    {">", ARITH_GT, 7}, {"+", ARITH_ADD, 9}, {"-", ARITH_SUB, 9}, {"*", ARITH_MUL, 10},
+    {"/", ARITH_DIV, 10}, {"%", ARITH_MOD, 10},
+};
+
+#define ARITH_NUM_BINARY (sizeof(arith_binary) / sizeof(arith_binary[0]))
+
+ArithExpr arith_cache[ARITH_CACHE_SIZE];
+
+int arith_value(const char *text, size_t len, int depth, int64_t *result);
+
+/* arith_apply: a binary operator on two values, wrapping on overflow. Returns -1 on division by zero. */
+int arith_apply(ArithOp op, int64_t a, int64_t b, int64_t *result) {
+    uint64_t x = (uint64_t)a;
+    uint64_t y = (uint64_t)b;
+
+    switch (op) {
+        case ARITH_MUL: *result = (int64_t)(x * y); break;
+        case ARITH_ADD: *result = (int64_t)(x + y); break;
+        case ARITH_SUB: *result = (int64_t)(x - y); break;
+        case ARITH_SHL: *result = (int64_t)(x << (y & 63)); break;
+        case ARITH_SHR: *result = a >> (y & 63); break;
+        case ARITH_LT: *result = a < b; break;
+        case ARITH_LE: *result = a <= b; break;
+        case ARITH_GT: *result = a > b; break;
+        case ARITH_GE: *result = a >= b; break;
+        case ARITH_EQ: *result = a == b; break;
+        case ARITH_NE: *result = a != b; break;
+        case ARITH_AND: *result = a & b; break;
+        case ARITH_XOR: *result = a ^ b; break;
+        case ARITH_OR: *result = a | b; break;
+        case ARITH_LAND: *result = a && b; break;
+        case ARITH_LOR: *result = a || b; break;
+
+        case ARITH_DIV:
+        case ARITH_MOD:
+            if (b == 0) {
+                fprintf(stderr, "arithmetic: division by zero\n");
+                return -1;
+            }
+            if (b == -1) {
+                *result = op == ARITH_DIV ? (int64_t)(0 - x) : 0;
+            }
+            else {
+                *result = op == ARITH_DIV ? a / b : a % b;
+            }
+            break;
+
+        default:
+            *result = 0;
+            break;
+    }
+
+    return 0;
+}
+
+void arith_skip(ArithParser *parser) {
+    while (parser->p < parser->end && isspace((unsigned char)*parser->p)) {
+        parser->p++;
+    }
+}
+
+/* arith_accept: consume op if it comes next (and is not the start of op=, when no_assign). */
+int arith_accept(ArithParser *parser, const char *op, int no_assign) {
+    size_t len = strlen(op);
+
+    arith_skip(parser);
+    if ((size_t)(parser->end - parser->p) < len || memcmp(parser->p, op, len) != 0) {
+        return 0;
+    }
+
+    if (no_assign && parser->p + len < parser->end && parser->p[len] == '=') {
+        return 0;
+    }
+
+    parser->p += len;
+    return 1;
+}
+
+int arith_node(ArithParser *parser, ArithOp op, int left, int right) {
+    ArithNode *node = &parser->nodes[parser->num_nodes];
+
+    memset(node, 0, sizeof(*node));
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    node->third = -1;
+    return parser->num_nodes++;
+}
+
+int arith_is_num(ArithParser *parser, int index) {
+    return index >= 0 && parser->nodes[index].op == ARITH_NUM;
+}
+
+int arith_assign(ArithParser *parser);
+
+/* arith_name: a name at the cursor, or 0. */
+int arith_name(ArithParser *parser) {
+    const char *p = parser->p;
+
+    if (p >= parser->end || (!isalpha((unsigned char)*p) && *p != '_')) {
+        return 0;
+    }
+
+    while (p < parser->end && (isalnum((unsigned char)*p) || *p == '_')) {
+        p++;
+    }
+
+    return p - parser->p;
+}
+
+int arith_primary(ArithParser *parser) {
+    int len;
+
+    arith_skip(parser);
+
+    /* $(( )) inside an expression is just a parenthesized one. */
+    if (parser->p + 1 < parser->end && parser->p[0] == '$' && parser->p[1] == '(') {
+        parser->p++;
+    }
+
+    if (arith_accept(parser, "(", 0)) {
+        int inner = arith_assign(parser);
+
+        while (!parser->error && arith_accept(parser, ",", 0)) {
+            inner = arith_node(parser, ARITH_COMMA, inner, arith_assign(parser));
+        }
+
+        if (!arith_accept(parser, ")", 0)) {
+            parser->error = 1;
+        }
+        return inner;
+    }
+
+    if (parser->p < parser->end && isdigit((unsigned char)*parser->p)) {
+        char *number_end;
+        uint64_t value = strtoull(parser->p, &number_end, 0);
+        int index = arith_node(parser, ARITH_NUM, -1, -1);
+
+        if (number_end > parser->end || isalnum((unsigned char)*number_end) || *number_end == '_') {
+            parser->error = 1;
+        }
+
+        parser->nodes[index].value = (int64_t)value;
+        parser->p = number_end;
+        return index;
+    }
+
+    if (parser->p < parser->end && *parser->p == '$') {
+        const char *name = ++parser->p;
+        int index = arith_node(parser, ARITH_PARAM, -1, -1);
+
+        if (name < parser->end && *name == '{') {
+            const char *close = memchr(name, '}', parser->end - name);
+
+            if (close == NULL) {
+                parser->error = 1;
+                return index;
+            }
+            name++;
+            parser->p = close + 1;
+            len = close - name;
+        }
+
+        else if ((len = arith_name(parser)) == 0) {
+            len = name < parser->end && strchr("?$!#@*0123456789", *name) != NULL && *name != '\0';
+            if (len == 0) {
+                parser->error = 1;
+            }
+            parser->p += len;
+        }
+
+        else {
+            parser->p += len;
+        }
+
+        parser->nodes[index].name = name - parser->text;
+        parser->nodes[index].name_len = len;
+        return index;
+    }
+
+    if ((len = arith_name(parser)) > 0) {
+        int index = arith_node(parser, ARITH_VAR, -1, -1);
+
+        parser->nodes[index].name = parser->p - parser->text;
+        parser->nodes[index].name_len = len;
+        parser->p += len;
+
+        if (arith_accept(parser, "++", 0) || arith_accept(parser, "--", 0)) {
+            parser->nodes[index].op = parser->p[-1] == '+' ? ARITH_POST_INC : ARITH_POST_DEC;
+        }
+        return index;
+    }
+
+    parser->error = 1;
+    return -1;
+}
+
+int arith_unary(ArithParser *parser) {
+    ArithOp op;
+
+    if (arith_accept(parser, "++", 0) || arith_accept(parser, "--", 0)) {
+        op = parser->p[-1] == '+' ? ARITH_PRE_INC : ARITH_PRE_DEC;
+        arith_skip(parser);
+
+        int len = arith_name(parser);
+        int index = arith_node(parser, op, -1, -1);
+
+        if (len == 0) {
+            parser->error = 1;
+        }
+        parser->nodes[index].name = parser->p - parser->text;
+        parser->nodes[index].name_len = len;
+        parser->p += len;
+        return index;
+    }
+
+    if (arith_accept(parser, "-", 1)) {
+        op = ARITH_NEG;
+    }
+
+    else if (arith_accept(parser, "+", 1)) {
+        return arith_unary(parser);
+    }
+
+    else if (arith_accept(parser, "!", 1)) {
+        op = ARITH_NOT;
+    }
+
+    else if (arith_accept(parser, "~", 0)) {
+        op = ARITH_BITNOT;
+    }
+
+    else {
+        return arith_primary(parser);
+    }
+
+    int operand = arith_unary(parser);
+
+    /* Folded: the constant node takes the result. */
+    if (arith_is_num(parser, operand)) {
+        int64_t *value = &parser->nodes[operand].value;
+
+        *value = op == ARITH_NEG ? (int64_t)(0 - (uint64_t)*value) : op == ARITH_NOT ? !*value : ~*value;
+        return operand;
+    }
+
+    return arith_node(parser, op, operand, -1);
+}
+
+/* arith_binary_op: precedence climbing over the operators of at least min_prec. */
+int arith_binary_op(ArithParser *parser, int min_prec) {
+    int left = arith_unary(parser);
+
+    while (!parser->error) {
+        size_t i;
+
+        arith_skip(parser);
+        for (i = 0; i < ARITH_NUM_BINARY; i++) {
+            size_t len = strlen(arith_binary[i].text);
+
+            if ((size_t)(parser->end - parser->p) >= len && memcmp(parser->p, arith_binary[i].text, len) == 0) {
+                break;
+            }
+        }
+
+        /* An operator with an op= form followed by '=' is an assignment, not this operator. */
+        if (i == ARITH_NUM_BINARY || arith_binary[i].prec < min_prec
+            || !arith_accept(parser, arith_binary[i].text, arith_binary[i].op < ARITH_LT || (arith_binary[i].op >= ARITH_AND && arith_binary[i].op <= ARITH_OR))) {
+            break;
+        }
+
+        int right = arith_binary_op(parser, arith_binary[i].prec + 1);
+        int64_t value;
+
+        if (arith_is_num(parser, left) && arith_is_num(parser, right)
+            && !((arith_binary[i].op == ARITH_DIV || arith_binary[i].op == ARITH_MOD) && parser->nodes[right].value == 0)) {
+            arith_apply(arith_binary[i].op, parser->nodes[left].value, parser->nodes[right].value, &value);
+            parser->nodes[left].value = value;
+        }
+
+        else {
+            left = arith_node(parser, arith_binary[i].op, left, right);
+        }
+    }
+
+    return left;
+}
+
+int arith_conditional(ArithParser *parser) {
+    int cond = arith_binary_op(parser, 1);
+
+    if (parser->error || !arith_accept(parser, "?", 0)) {
+        return cond;
+    }
+
+    int then = arith_assign(parser);
+
+    if (!arith_accept(parser, ":", 0)) {
+        parser->error = 1;
+        return cond;
+    }
+
+    int otherwise = arith_conditional(parser);
+
+    if (arith_is_num(parser, cond)) {
+        return parser->nodes[cond].value ? then : otherwise;
+    }
+
+    int index = arith_node(parser, ARITH_COND, cond, then);
+    parser->nodes[index].third = otherwise;
+    return index;
+}
+
+int arith_assign(ArithParser *parser) {
+    static const struct {
+        const char *text;
+        ArithOp op;
+    } assign_ops[] = {
+        {"<<=", ARITH_SHL}, {">>=", ARITH_SHR}, {"+=", ARITH_ADD}, {"-=", ARITH_SUB}, {"*=", ARITH_MUL},
+        {"/=", ARITH_DIV}, {"%=", ARITH_MOD}, {"&=", ARITH_AND}, {"^=", ARITH_XOR}, {"|=", ARITH_OR},
+    };
+    const char *start;
+    int len;
+
+    arith_skip(parser);
+    start = parser->p;
+    len = arith_name(parser);
+
+    if (len > 0) {
+        ArithOp op = ARITH_NUM;
+
+        parser->p += len;
+        if (arith_accept(parser, "=", 1)) {
+            op = ARITH_ASSIGN;
+        }
+
+        for (size_t i = 0; op == ARITH_NUM && i < sizeof(assign_ops) / sizeof(assign_ops[0]); i++) {
+            if (arith_accept(parser, assign_ops[i].text, 0)) {
+                op = assign_ops[i].op;
+            }
+        }
+
+        if (op != ARITH_NUM) {
+            int index = arith_node(parser, ARITH_ASSIGN, -1, arith_assign(parser));
+
+            parser->nodes[index].assign_op = op;
+            parser->nodes[index].name = start - parser->text;
+            parser->nodes[index].name_len = len;
+            return index;
+        }
+
+        parser->p = start;
+    }
+
+    return arith_conditional(parser);
+}
+
+/* arith_compile: parse text into expr->nodes. Returns -1 after reporting a syntax error. */
+int arith_compile(ArithExpr *expr) {
+    ArithParser parser = {expr->text, expr->text, expr->text + expr->len, NULL, 0, 0};
+
+    expr->nodes = malloc((expr->len + 1) * sizeof(ArithNode));
+    if (expr->nodes == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    parser.nodes = expr->nodes;
+
+    arith_skip(&parser);
+    expr->root = -1;
+    if (parser.p < parser.end) {
+        expr->root = arith_assign(&parser);
+        while (!parser.error && arith_accept(&parser, ",", 0)) {
+            expr->root = arith_node(&parser, ARITH_COMMA, expr->root, arith_assign(&parser));
+        }
+        arith_skip(&parser);
+    }
+
+    if (parser.error || parser.p < parser.end) {
+        fprintf(stderr, "arithmetic: syntax error in expression: %s\n", expr->text);
+        free(expr->nodes);
+        expr->nodes = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int arith_store(ArithExpr *expr, ArithNode *node, int64_t value) {
+    char number[24];
+
+    snprintf(number, sizeof(number), "%lld", (long long)value);
+    var_set(expr->text + node->name, node->name_len, number, 0);
+    return 0;
+}
+
+int arith_eval_node(ArithExpr *expr, int index, int depth, int64_t *result) {
+    ArithNode *node = &expr->nodes[index];
+    int64_t a, b;
+
+    switch (node->op) {
+        case ARITH_NUM:
+            *result = node->value;
+            return 0;
+
+        case ARITH_VAR:
+        case ARITH_PRE_INC:
+        case ARITH_PRE_DEC:
+        case ARITH_POST_INC:
+        case ARITH_POST_DEC: {
+            const char *value = var_lookup(expr->text + node->name, node->name_len);
+
+            if (arith_value(value, value != NULL ? strlen(value) : 0, depth, &a) == -1) {
+                return -1;
+            }
+
+            *result = a;
+            if (node->op == ARITH_VAR) {
+                return 0;
+            }
+
+            b = (int64_t)((uint64_t)a + (node->op == ARITH_PRE_INC || node->op == ARITH_POST_INC ? 1 : -1));
+            if (node->op == ARITH_PRE_INC || node->op == ARITH_PRE_DEC) {
+                *result = b;
+            }
+            return arith_store(expr, node, b);
+        }
+
+        case ARITH_PARAM: {
+            WordBuffer buf = {arena_alloc(&line_arena, 32), 0, 32};
+
+            append_parameter(&buf, expr->text + node->name, node->name_len);
+            return arith_value(buf.data, buf.len, depth, result);
+        }
+
+        case ARITH_NEG:
+        case ARITH_NOT:
+        case ARITH_BITNOT:
+            if (arith_eval_node(expr, node->left, depth, &a) == -1) {
+                return -1;
+            }
+            *result = node->op == ARITH_NEG ? (int64_t)(0 - (uint64_t)a) : node->op == ARITH_NOT ? !a : ~a;
+            return 0;
+
+        case ARITH_LAND:
+        case ARITH_LOR:
+            if (arith_eval_node(expr, node->left, depth, &a) == -1) {
+                return -1;
+            }
+            if ((node->op == ARITH_LAND) == (a == 0)) {
+                *result = a != 0;
+                return 0;
+            }
+            if (arith_eval_node(expr, node->right, depth, &b) == -1) {
+                return -1;
+            }
+            *result = b != 0;
+            return 0;
+
+        case ARITH_COND:
+            if (arith_eval_node(expr, node->left, depth, &a) == -1) {
+                return -1;
+            }
+            return arith_eval_node(expr, a ? node->right : node->third, depth, result);
+
+        case ARITH_COMMA:
+            if (arith_eval_node(expr, node->left, depth, &a) == -1) {
+                return -1;
+            }
+            return arith_eval_node(expr, node->right, depth, result);
+
+        case ARITH_ASSIGN:
+            if (arith_eval_node(expr, node->right, depth, &b) == -1) {
+                return -1;
+            }
+
+            if (node->assign_op != ARITH_ASSIGN) {
+                const char *value = var_lookup(expr->text + node->name, node->name_len);
+
+                if (arith_value(value, value != NULL ? strlen(value) : 0, depth, &a) == -1
+                    || arith_apply(node->assign_op, a, b, &b) == -1) {
+                    return -1;
+                }
+            }
+
+            *result = b;
+            return arith_store(expr, node, b);
+
+        default:
+            if (arith_eval_node(expr, node->left, depth, &a) == -1
+                || arith_eval_node(expr, node->right, depth, &b) == -1) {
+                return -1;
+            }
+            return arith_apply(node->op, a, b, result);
+    }
+}
+
+/*
+ * arith_value: the value of a variable's text: 0 if empty, the number if it
+ * is one, else the value of the text as an expression (depth bounds that).
+ */
+int arith_value(const char *text, size_t len, int depth, int64_t *result) {
+    char *end;
+
+    while (len > 0 && isspace((unsigned char)*text)) {
+        text++;
+        len--;
+    }
+
+    if (len == 0) {
+        *result = 0;
+        return 0;
+    }
+
+    if (isdigit((unsigned char)*text)) {
+        *result = (int64_t)strtoull(text, &end, 0);
+        if (end == text + len) {
+            return 0;
+        }
+    }
+
+    if (depth >= ARITH_MAX_DEPTH) {
+        fprintf(stderr, "arithmetic: expression recursion level exceeded\n");
+        return -1;
+    }
+
+    ArithExpr expr = {arena_strndup(&line_arena, text, len), len, 0, NULL, -1};
+    int status = arith_compile(&expr);
+
+    if (status == 0) {
+        *result = 0;
+        status = expr.root == -1 ? 0 : arith_eval_node(&expr, expr.root, depth + 1, result);
+        free(expr.nodes);
+    }
+
+    return status;
+}
+
+/*
+ * arith_eval: evaluate the expression text[0..len) into *result, compiling
+ * it only if the cache does not hold it. Returns -1 after reporting an error.
+ */
+int arith_eval(const char *text, size_t len, int64_t *result) {
+    unsigned int hash = hash_bytes(text, len);
+    ArithExpr *expr = &arith_cache[hash & (ARITH_CACHE_SIZE - 1)];
+
+    if (expr->text == NULL || expr->hash != hash || expr->len != len || memcmp(expr->text, text, len) != 0) {
+        free(expr->text);
+        free(expr->nodes);
+        expr->nodes = NULL;
+        expr->text = strndup(text, len);
+        expr->len = len;
+        expr->hash = hash;
+        if (expr->text == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        if (arith_compile(expr) == -1) {
+            free(expr->text);
+            expr->text = NULL;
+            return -1;
+        }
+    }
+
+    *result = 0;
+    return expr->root == -1 ? 0 : arith_eval_node(expr, expr->root, 0, result);
+}
+
+/* let expr...: evaluate each; the status is 0 when the last value is non-zero. */
+int builtin_let(char **args) {
+    int64_t value = 0;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "let: expression expected\n");
+        return 1;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (arith_eval(args[i], strlen(args[i]), &value) == -1) {
+            return 1;
+        }
+    }
+
+    return value == 0;
+}
+
+/*
+ * Pipelines: every stage is started before any is waited for, joined by
+ * O_CLOEXEC pipes so no stage inherits another stage's ends. An output-only
+ * builtin in the first stage runs in the shell itself, writing to a memfd
+ * that is then spliced into the pipe without a copy through userspace; other
+ * builtin stages are forked. SIMPLE_SHELL_PIPE_SIZE enlarges the pipes
+ * (F_SETPIPE_SZ) for bulk-data pipelines. The status of each stage is kept
+ * in pipe_status and exported as PIPESTATUS.
+ */
+int pipe_status[MAX_PIPELINE];
+int pipe_status_count = 0;
+int interactive = 0;
+int arena_debug = 0;
+
+typedef struct {
+    char *command;
+    char **args;
+} BuiltinStage;
+
+typedef struct {
+    Ast *ast;
+    int index;
+} NodeRef;
+
+int run_node(void *data);
+void start_job(Ast *ast, int index);
+
+int run_builtin_stage(void *data) {
+    BuiltinStage *stage = data;
+    int status = 0;
+
+    execute_builtin(stage->command, stage->args, &status);
+    fflush(stdout);
+
+    return status;
+}
+
+/* Runs an output-only builtin in the shell, returning a memfd holding what it printed. */
+int capture_builtin(char *command, char **args, int *status) {
+    int captured = memfd_create("builtin", MFD_CLOEXEC);
+    int saved = -1;
+
+    if (captured == -1 || (saved = dup(STDOUT_FILENO)) == -1) {
+        perror("memfd_create");
+        if (captured != -1) {
+            close(captured);
+        }
+        *status = 1;
+        return -1;
+    }
+
+    fflush(stdout);
+    dup2(captured, STDOUT_FILENO);
+    execute_builtin(command, args, status);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    return captured;
+}
+
+void splice_to_pipe(int from, int to) {
+    struct sigaction ignore, old;
+    loff_t offset = 0;
+
+    /* A consumer that exits early must not take the shell down with SIGPIPE. */
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+
+    while (splice(from, &offset, to, NULL, PIPE_SPLICE_CHUNK, SPLICE_F_MOVE) > 0) {
+        ;
+    }
+
+    sigaction(SIGPIPE, &old, NULL);
+}
+
+void export_pipe_status(void) {
+    char value[MAX_PIPELINE * 5];
+    size_t len = 0;
+
+    value[0] = '\0';
+    for (int i = 0; i < pipe_status_count; i++) {
+        len += snprintf(value + len, sizeof(value) - len, i == 0 ? "%d" : " %d", pipe_status[i]);
+    }
+
+    var_set("PIPESTATUS", 10, value, VAR_EXPORT);
+}
+
+/*
+ * start_pipeline: start every stage of the pipeline (or single command) at
+ * index, storing the pids (-1 for a stage that ran in the shell or failed
+ * to start) and the statuses known so far. Returns the number of stages.
+ */
+int start_pipeline(Ast *ast, int index, pid_t *pids, int *statuses) {
+    char **args[MAX_PIPELINE];
+    char **envps[MAX_PIPELINE];
+    BuiltinStage builtins[MAX_PIPELINE];
+    NodeRef compound[MAX_PIPELINE];
+    int pipes[MAX_PIPELINE][2];
+    int num_stages = 0;
+    int num_pipes = 0;
+    int captured = -1;
+    int status = 0;
+    uint64_t failed = 0;
+    int child = ast->nodes[index].type == NODE_PIPELINE ? ast->nodes[index].child : index;
+
+    /* Simple stages get an argv; groups and subshells run in a forked shell. */
+    for (; child != -1 && num_stages < MAX_PIPELINE; child = child == index ? -1 : ast->nodes[child].next) {
+        Node *node = &ast->nodes[child];
+
+        args[num_stages] = NULL;
+        envps[num_stages] = NULL;
+        compound[num_stages].ast = ast;
+        compound[num_stages].index = child;
+        if (node->type == NODE_SIMPLE) {
+            args[num_stages] = arena_alloc(&line_arena, (node->num_tokens + 1) * sizeof(char *));
+            expand_failed = 0;
+            build_argv(ast->tokens + node->first_token, node->num_tokens, args[num_stages]);
+            args[num_stages] += split_assignments(args[num_stages], &envps[num_stages]);
+
+            /* A stage whose expansion failed is not run and fails. */
+            if (expand_failed) {
+                args[num_stages][0] = NULL;
+                failed |= (uint64_t)1 << num_stages;
+            }
+        }
+        num_stages++;
+    }
+
+    for (int i = 0; status == 0 && i < num_stages - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe2");
+            status = 1;
+            break;
+        }
+
+        num_pipes++;
+
+        const char *size = var_get("SIMPLE_SHELL_PIPE_SIZE");
+        if (size != NULL && atoi(size) > 0 && fcntl(pipes[i][1], F_SETPIPE_SZ, atoi(size)) == -1) {
+            perror("F_SETPIPE_SZ");
+        }
+    }
+
+    for (int i = 0; i < num_stages; i++) {
+        pids[i] = -1;
+        statuses[i] = status != 0 ? status : (int)((failed >> i) & 1);
+    }
+
+    for (int i = 0; status == 0 && i < num_stages; i++) {
+        int in = i > 0 ? pipes[i - 1][0] : STDIN_FILENO;
+        int out = i < num_stages - 1 ? pipes[i][1] : STDOUT_FILENO;
+        int builtin = args[i] != NULL && args[i][0] != NULL ? is_builtin(args[i][0]) : 0;
+        SpawnRequest req = {0};
+        int error;
+
+        /* Nothing but assignments, or words that expanded to nothing: there is no command to start. */
+        if (args[i] != NULL && args[i][0] == NULL) {
+            continue;
+        }
+
+        if (in != STDIN_FILENO) {
+            spawn_add_dup2(&req, in, STDIN_FILENO);
+        }
+        if (out != STDOUT_FILENO) {
+            spawn_add_dup2(&req, out, STDOUT_FILENO);
+        }
+
+        if (builtin == BUILTIN_OUTPUT && i == 0 && num_stages > 1) {
+            captured = capture_builtin(args[i][0], args[i], &statuses[i]);
+        }
+
+        else if (builtin != 0) {
+            builtins[i].command = args[i][0];
+            builtins[i].args = args[i];
+            req.child_fn = run_builtin_stage;
+            req.child_data = &builtins[i];
+
+            pids[i] = spawn_process(&req, &error);
+            if (pids[i] == -1) {
+                fprintf(stderr, "%s: %s\n", args[i][0], strerror(error));
+                statuses[i] = 1;
+            }
+        }
+
+        else if (args[i] == NULL) {
+            req.child_fn = run_node;
+            req.child_data = &compound[i];
+
+            pids[i] = spawn_process(&req, &error);
+            if (pids[i] == -1) {
+                fprintf(stderr, "fork: %s\n", strerror(error));
+                statuses[i] = 1;
+            }
+        }
+
+        else {
+            req.envp = envps[i];
+            pids[i] = launch_command(args[i], &req, &statuses[i]);
+        }
+    }
+
+    for (int i = 0; i < num_pipes; i++) {
+        close(pipes[i][0]);
+        if (i != 0 || captured == -1) {
+            close(pipes[i][1]);
+        }
+    }
+
+    if (captured != -1) {
+        splice_to_pipe(captured, pipes[0][1]);
+        close(pipes[0][1]);
+        close(captured);
+    }
+
+    return num_stages;
+}
+
+int execute_simple(Ast *ast, int index) {
+    Node *node = &ast->nodes[index];
+    char **argv = arena_alloc(&line_arena, (node->num_tokens + 1) * sizeof(char *));
+    char **envp;
+    int status;
+
+    /* A simple command keeps the shell's own fds and may change shell state. */
+    expand_failed = 0;
+    substitution_status = -1;
+    build_argv(ast->tokens + node->first_token, node->num_tokens, argv);
+    if (expand_failed) {
+        return 1;
+    }
+
+    int skip = split_assignments(argv, &envp);
+
+    /* Only assignments: they set shell variables, exported ones staying exported. */
+    if (argv[skip] == NULL) {
+        for (int i = 0; i < skip; i++) {
+            size_t len = is_assignment(argv[i]);
+
+            var_set(argv[i], len, argv[i] + len + 1, 0);
+        }
+        return substitution_status != -1 ? substitution_status : 0;
+    }
+
+    argv += skip;
+    if (!execute_builtin(argv[0], argv, &status)) {
+        status = execute_command(argv[0], argv, envp);
+    }
+
+    return status;
+}
+
+int execute_pipeline(Ast *ast, int index) {
+    pid_t pids[MAX_PIPELINE];
+    int num_stages = start_pipeline(ast, index, pids, pipe_status);
+
+    for (int i = 0; i < num_stages; i++) {
+        int wstatus;
+
+        if (pids[i] != -1 && waitpid(pids[i], &wstatus, 0) != -1) {
+            pipe_status[i] = wait_status(wstatus);
+        }
+    }
+
+    pipe_status_count = num_stages;
+    export_pipe_status();
+
+    return pipe_status[num_stages - 1];
+}
+
+int execute_subshell(Ast *ast, int index) {
+    NodeRef ref = {ast, ast->nodes[index].child};
+    SpawnRequest req = {0};
+    int wstatus;
+    int error;
+
+    req.child_fn = run_node;
+    req.child_data = &ref;
+
+    pid_t pid = spawn_process(&req, &error);
+    if (pid == -1) {
+        fprintf(stderr, "fork: %s\n", strerror(error));
+        return 1;
+    }
+
+    if (waitpid(pid, &wstatus, 0) == -1) {
+        return 1;
+    }
+
+    return wait_status(wstatus);
+}
+
+/*
+ * execute_node: evaluate the subtree at index and return its status. && and
+ * || children are skipped as the status so far dictates, so `false && a || b`
+ * runs b; '&' items of a list are started with start_job.
+ */
+int execute_node(Ast *ast, int index) {
+    Node *node = &ast->nodes[index];
+    int status = 0;
+
+    switch (node->type) {
+        case NODE_SIMPLE:
+            return execute_simple(ast, index);
+
+        case NODE_PIPELINE:
+            return execute_pipeline(ast, index);
+
+        case NODE_GROUP:
+            return execute_node(ast, node->child);
+
+        case NODE_SUBSHELL:
+            return execute_subshell(ast, index);
+
+        case NODE_AND_OR:
+            for (int child = node->child; child != -1; child = ast->nodes[child].next) {
+                int flags = ast->nodes[child].flags;
+
+                if (!((flags & NODE_IF_SUCCESS) && status != 0) && !((flags & NODE_IF_FAILURE) && status == 0)) {
+                    status = execute_node(ast, child);
+                    last_status = status;
+                }
+            }
+            return status;
+
+        case NODE_LIST:
+            for (int child = node->child; child != -1; child = ast->nodes[child].next) {
+                if (ast->nodes[child].flags & NODE_ASYNC) {
+                    start_job(ast, child);
+                    status = 0;
+                }
+
+                else {
+                    status = execute_node(ast, child);
+                }
+                last_status = status;
+            }
+            return status;
+    }
+
+    return status;
+}
+
+int run_node(void *data) {
+    NodeRef *ref = data;
+    int status = execute_node(ref->ast, ref->index);
+
+    fflush(stdout);
+    return status;
+}
+
+/*
+ * command_substitute: append what text prints when run as a command, less
+ * its trailing newlines, and make its status $?. A lone output-only builtin
+ * (echo, printf, pwd, ...) runs in the shell with its output captured in a
+ * memfd; anything else runs in a forked shell whose output is read from a
+ * pipe straight into buf, which doubles as it fills.
+ */
+void command_substitute(WordBuffer *buf, char *text) {
+    size_t max_tokens = strlen(text) + 1;
+    Token *tokens = arena_alloc(&line_arena, max_tokens * sizeof(Token));
+    int num_tokens = lex_line(text, tokens, max_tokens);
+    int saved_failed = expand_failed;
+    size_t start = buf->len;
+    int status = 0;
+    int root = -1;
+    Ast ast;
+
+    if (num_tokens > 0 && (num_tokens = expand_aliases(&tokens, num_tokens)) > 0) {
+        root = parse_line(&ast, tokens, num_tokens);
+    }
+
+    if (num_tokens != 0 && root == -1) {
+        status = 2;
+    }
+
+    else if (root != -1 && ast.nodes[root].type == NODE_SIMPLE && !ast.nodes[root].flags
+             && !(tokens[ast.nodes[root].first_token].quoted & WORD_EXPAND)
+             && is_builtin(materialize_word(&tokens[ast.nodes[root].first_token])) == BUILTIN_OUTPUT) {
+        Node *node = &ast.nodes[root];
+        char **argv = arena_alloc(&line_arena, (node->num_tokens + 1) * sizeof(char *));
+        int captured;
+
+        expand_failed = 0;
+        build_argv(ast.tokens + node->first_token, node->num_tokens, argv);
+        captured = expand_failed ? -1 : capture_builtin(argv[0], argv, &status);
+        status = expand_failed ? 1 : status;
+
+        for (off_t offset = 0; captured != -1; ) {
+            word_reserve(buf, SUBST_READ_SIZE);
+
+            ssize_t n = pread(captured, buf->data + buf->len, buf->cap - buf->len - 1, offset);
+            if (n <= 0) {
+                close(captured);
+                break;
+            }
+            buf->len += n;
+            offset += n;
+        }
+    }
+
+    else if (root != -1) {
+        NodeRef ref = {&ast, root};
+        SpawnRequest req = {0};
+        int fds[2];
+        int wstatus;
+        int error;
+        pid_t pid;
+
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            status = 1;
+        }
+
+        else {
+            spawn_add_dup2(&req, fds[1], STDOUT_FILENO);
+            req.child_fn = run_node;
+            req.child_data = &ref;
+
+            pid = spawn_process(&req, &error);
+            close(fds[1]);
+            if (pid == -1) {
+                fprintf(stderr, "fork: %s\n", strerror(error));
+                status = 1;
+            }
+
+            while (pid != -1) {
+                word_reserve(buf, SUBST_READ_SIZE);
+
+                ssize_t n = read(fds[0], buf->data + buf->len, buf->cap - buf->len - 1);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                buf->len += n;
+            }
+            close(fds[0]);
+
+            if (pid != -1 && waitpid(pid, &wstatus, 0) != -1) {
+                status = wait_status(wstatus);
+            }
+        }
+    }
+
+    while (buf->len > start && buf->data[buf->len - 1] == '\n') {
+        buf->len--;
+    }
+
+    expand_failed = saved_failed;
+    last_status = status;
+    substitution_status = status;
+}
+
+/*
+ * command [-v] name args: run name as a builtin or from PATH, skipping any
+ * alias; -v prints how name would be resolved. builtin name args: run name
+ * only if it is a builtin.
+ */
+int builtin_command(char **args) {
+    int status = 0;
+
+    if (args[1] != NULL && strcmp(args[1], "-v") == 0) {
+        for (int i = 2; args[i] != NULL; i++) {
+            char *path;
+
+            if (is_builtin(args[i])) {
+                printf("%s\n", args[i]);
+            }
+
+            else if (strchr(args[i], '/') != NULL ? access(args[i], X_OK) == 0 : (path = hash_lookup(args[i])) != NULL) {
+                printf("%s\n", strchr(args[i], '/') != NULL ? args[i] : path);
+            }
+
+            else {
+                status = 1;
+            }
+        }
+
+        return status;
+    }
+
+    if (args[1] == NULL) {
+        return 0;
+    }
+
+    if (execute_builtin(args[1], args + 1, &status)) {
+        return status;
+    }
+
+    return execute_command(args[1], args + 1, NULL);
+}
+
+int builtin_builtin(char **args) {
+    int status = 0;
+
+    if (args[1] == NULL) {
+        return 0;
+    }
+
+    if (!execute_builtin(args[1], args + 1, &status)) {
+        fprintf(stderr, "builtin: %s: not a shell builtin\n", args[1]);
+        return 1;
+    }
+
+    return status;
+}
+
+/*
+ * parallel: run a command template once per input with at most -j workers
+ * (default: online CPUs). Inputs follow ":::" or are read from stdin, one
+ * per line; "{}" in the template is replaced by the input, otherwise it is
+ * appended. Each task writes into its own memfd, which is copied out whole
+ * when the task ends (in input order with -k/--keep-order), so outputs
+ * never interleave.
+ */
+typedef struct {
+    pid_t pid;
+    int output;
+    int status;
+    int done;
+} ParallelTask;
+
+char *substitute_input(const char *word, const char *input) {
+    size_t input_len = strlen(input);
+    size_t len = 0;
+    char *result = arena_alloc(&line_arena, strlen(word) * (input_len + 1) + 1);
+
+    while (*word != '\0') {
+        if (word[0] == '{' && word[1] == '}') {
+            memcpy(result + len, input, input_len);
+            len += input_len;
+            word += 2;
+        }
+
+        else {
+            result[len++] = *word++;
+        }
+    }
+
+    result[len] = '\0';
+    return result;
+}
+
+void start_parallel_task(ParallelTask *task, char **template, int template_len, const char *input) {
+    ArenaMark mark = arena_mark(&line_arena);
+    char **argv = arena_alloc(&line_arena, (template_len + 2) * sizeof(char *));
+    BuiltinStage builtin;
+    SpawnRequest req = {0};
+    int placeholder = 0;
+    int argc = 0;
+    int error;
+
+    task->pid = -1;
+    task->done = 0;
+    task->output = memfd_create("parallel", MFD_CLOEXEC);
+    if (task->output == -1) {
+        perror("parallel");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < template_len; i++) {
+        placeholder |= strstr(template[i], "{}") != NULL;
+        argv[argc++] = substitute_input(template[i], input);
+    }
+    if (!placeholder) {
+        argv[argc++] = arena_strndup(&line_arena, input, strlen(input));
+    }
+    argv[argc] = NULL;
+
+    spawn_add_dup2(&req, task->output, STDOUT_FILENO);
+
+    if (is_builtin(argv[0])) {
+        builtin.command = argv[0];
+        builtin.args = argv;
+        req.child_fn = run_builtin_stage;
+        req.child_data = &builtin;
+
+        task->pid = spawn_process(&req, &error);
+        if (task->pid == -1) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(error));
+            task->status = 1;
+        }
+    }
+
+    else {
+        task->pid = launch_command(argv, &req, &task->status);
+    }
+
+    if (task->pid == -1) {
+        task->done = 1;
+    }
+
+    arena_release(&line_arena, mark);
+}
+
+void print_parallel_task(ParallelTask *task) {
+    off_t offset = 0;
+    struct stat st;
+
+    fflush(stdout);
+    if (fstat(task->output, &st) == 0) {
+        while (offset < st.st_size && sendfile(STDOUT_FILENO, task->output, &offset, st.st_size - offset) > 0) {
+            ;
+        }
+    }
+
+    /* sendfile refuses some outputs (O_APPEND files among them): copy the rest by hand. */
+    if (offset < st.st_size) {
+        char buffer[PIPE_SPLICE_CHUNK];
+        ssize_t n;
+
+        while ((n = pread(task->output, buffer, sizeof(buffer), offset)) > 0 && write(STDOUT_FILENO, buffer, n) == n) {
+            offset += n;
+        }
+    }
+
+    close(task->output);
+    task->output = -1;
+}
+
+int builtin_parallel(char **args) {
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-k") == 0 || strcmp(args[i], "--keep-order") == 0) {
+            keep_order = 1;
+        }
+
+        else if (strncmp(args[i], "-j", 2) == 0) {
+            char *count = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+
+            if (count == NULL || atoi(count) <= 0) {
+                fprintf(stderr, "Usage: parallel [-j N] [-k] command [args] [::: inputs]\n");
+                return 1;
+            }
+            workers = atoi(count);
+        }
+
+        else {
+            fprintf(stderr, "parallel: unknown option %s\n", args[i]);
+            return 1;
+        }
+    }
+
+    char **template = args + i;
+    int template_len = 0;
+
+    while (template[template_len] != NULL && strcmp(template[template_len], ":::") != 0) {
+        template_len++;
+    }
+
+    if (template_len == 0) {
+        fprintf(stderr, "Usage: parallel [-j N] [-k] command [args] [::: inputs]\n");
+        return 1;
+    }
+
+    char **inputs = NULL;
+    int num_inputs = 0;
+    int inputs_capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+
+    if (template[template_len] != NULL) {
+        inputs = template + template_len + 1;
+        while (inputs[num_inputs] != NULL) {
+            num_inputs++;
+        }
+    }
+
+    else {
+        ssize_t line_len;
+
+        while ((line_len = getline(&line, &line_capacity, stdin)) != -1) {
+            if (line_len > 0 && line[line_len - 1] == '\n') {
+                line[line_len - 1] = '\0';
+            }
+
+            if (num_inputs == inputs_capacity) {
+                inputs_capacity = inputs_capacity ? inputs_capacity * 2 : 64;
+                inputs = realloc(inputs, inputs_capacity * sizeof(char *));
+                if (inputs == NULL) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            inputs[num_inputs++] = strdup(line);
+        }
+
+        free(line);
+        clearerr(stdin);
+    }
+
+    ParallelTask *tasks = calloc(num_inputs > 0 ? num_inputs : 1, sizeof(ParallelTask));
+    int started = 0, running = 0, finished = 0, printed = 0, failed = 0;
+    char buffer[64];
+
+    if (tasks == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while (printed < num_inputs) {
+        while (running < workers && started < num_inputs) {
+            start_parallel_task(&tasks[started], template, template_len, inputs[started]);
+            if (!tasks[started].done) {
+                running++;
+            }
+            started++;
+        }
+
+        /* Drain before checking so a SIGCHLD that lands after the check still wakes us. */
+        while (read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0) {
+            ;
+        }
+
+        for (int t = 0; t < started; t++) {
+            int wstatus;
+
+            if (!tasks[t].done && waitpid(tasks[t].pid, &wstatus, WNOHANG) == tasks[t].pid) {
+                tasks[t].status = wait_status(wstatus);
+                tasks[t].done = 1;
+                running--;
+            }
+        }
+
+        for (int t = keep_order ? printed : 0; t < started; t++) {
+            if (tasks[t].done && tasks[t].output != -1) {
+                print_parallel_task(&tasks[t]);
+                failed += tasks[t].status != 0;
+                printed++;
+            }
+
+            else if (keep_order) {
+                break;
+            }
+        }
+
+        if (printed < num_inputs && finished == printed && running > 0) {
+            wait_for_sigchld();
+        }
+        finished = printed;
+    }
+
+    if (template[template_len] == NULL) {
+        for (int t = 0; t < num_inputs; t++) {
+            free(inputs[t]);
+        }
+        free(inputs);
+    }
+    free(tasks);
+
+    /* Let reap_jobs look at background jobs whose SIGCHLD we consumed. */
+    reap_jobs(0);
+
+    return failed > 101 ? 101 : failed;
+}
+
+/* start_job: launch the subtree at index in the background without waiting for it. */
+void start_job(Ast *ast, int index) {
+    Node *node = &ast->nodes[index];
+    Job *job = add_job(token_text(ast->tokens + node->first_token, node->num_tokens));
+
+    /* A pipeline runs as it would in the foreground; anything else needs a subshell. */
+    if (node->type == NODE_SIMPLE || node->type == NODE_PIPELINE) {
+        job->num_pids = start_pipeline(ast, index, job->pids, job->statuses);
+    }
+
+    else {
+        NodeRef ref = {ast, index};
+        SpawnRequest req = {0};
+        int error;
+
+        req.child_fn = run_node;
+        req.child_data = &ref;
+
+        job->num_pids = 1;
+        job->pids[0] = spawn_process(&req, &error);
+        job->statuses[0] = 1;
+        if (job->pids[0] == -1) {
+            fprintf(stderr, "fork: %s\n", strerror(error));
+        }
+    }
+
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->pids[i] != -1) {
+            job->running++;
+            last_background_pid = job->pids[i];
+        }
+    }
+
+    if (interactive) {
+        printf("[%d] %d\n", job->id, last_background_pid);
+    }
+}
+
+/* finish_line: release a line's temporaries. Only the outermost line resets the peak, nested ones are part of it. */
+void finish_line(ArenaMark mark) {
+    if (mark.total == 0) {
+        if (arena_debug) {
+            fprintf(stderr, "arena: peak %zu bytes\n", line_arena.peak);
+        }
+        line_arena.peak = 0;
+    }
+    arena_release(&line_arena, mark);
+}
+
+/* execute_line: lex, parse and run line, returning the status of the last command. */
+int execute_line(char *line) {
+    ArenaMark mark = arena_mark(&line_arena);
+    int max_tokens = strlen(line) + 1;
+    Token *tokens = arena_alloc(&line_arena, max_tokens * sizeof(Token));
+    int num_tokens = lex_line(line, tokens, max_tokens);
+
+    Ast ast;
+
+    if (num_tokens == -1) {
+        last_status = 2;
+    }
+
+    else if (num_tokens > 0 && (num_tokens = expand_aliases(&tokens, num_tokens)) == -1) {
+        last_status = 2;
+    }
+
+    else if (num_tokens > 0) {
+        int root = parse_line(&ast, tokens, num_tokens);
+
+        last_status = root == -1 ? 2 : execute_node(&ast, root);
+    }
+
+    finish_line(mark);
+    return last_status;
+}
+
+/*
+ * LineReader: block-buffered line input for one fd. Lines are found with
+ * memchr over whole reads and handed out as views into the buffer, the
+ * '\n' replaced by a NUL, so a line that arrived in one read is never
+ * copied. The buffer is compacted before a refill and doubled only when a
+ * single line outgrows it. Each fd gets its own reader, so `source` can
+ * read a file while the outer script or terminal keeps its place.
+ *
+ * Regular files are not read at all: reader_open maps them MAP_PRIVATE
+ * with MADV_SEQUENTIAL and the reader hands out lines straight from the
+ * mapping, already at end of input. The lexer's in-place NULs only dirty
+ * pages privately. An anonymous page is reserved behind the file so a
+ * last line without '\n' can still be terminated. Pipes, FIFOs and
+ * terminals fall back to reads.
+ */
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    int eof;
+    size_t mapped;
+} LineReader;
+
+void reader_init(LineReader *reader, int fd) {
+    reader->fd = fd;
+    reader->capacity = READER_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->mapped = 0;
+
+    if (reader->buffer == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* reader_open: a reader for fd that maps it when it is a regular file and streams otherwise. */
+void reader_open(LineReader *reader, int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = st.st_size;
+        size_t length = size + sysconf(_SC_PAGESIZE);
+        char *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (region != MAP_FAILED) {
+            if (mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                madvise(region, size, MADV_SEQUENTIAL);
+
+                reader->fd = fd;
+                reader->buffer = region;
+                reader->capacity = length;
+                reader->start = 0;
+                reader->end = size;
+                reader->eof = 1;
+                reader->mapped = length;
+                return;
+            }
+            munmap(region, length);
+        }
+    }
+
+    reader_init(reader, fd);
+}
+
+void reader_free(LineReader *reader) {
+    if (reader->mapped != 0) {
+        munmap(reader->buffer, reader->mapped);
+    }
+
+    else {
+        free(reader->buffer);
+    }
+    reader->buffer = NULL;
+}
+
+/*
+ * reader_getline: the next line without its '\n', NUL-terminated, valid
+ * until the next call. Stores its length in *length. Returns NULL at end
+ * of input; a last line without a newline is still returned.
+ */
+char *reader_getline(LineReader *reader, size_t *length) {
+    size_t scanned = reader->start;
+
+    while (1) {
+        char *newline = memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+        char *line = reader->buffer + reader->start;
+
+        if (newline == NULL && reader->eof && reader->start < reader->end) {
+            newline = reader->buffer + reader->end;
+        }
+
+        if (newline != NULL) {
+            *newline = '\0';
+            *length = newline - line;
+            reader->start = newline < reader->buffer + reader->end ? (size_t)(newline - reader->buffer) + 1 : reader->end;
+            return line;
+        }
+
+        if (reader->eof) {
+            return NULL;
+        }
+
+        /* Keep one byte free so a final line without '\n' can be terminated. */
+        if (reader->capacity - reader->end - 1 < READER_BUFFER_SIZE / 4 && reader->start > 0) {
+            memmove(reader->buffer, line, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        if (reader->capacity - reader->end - 1 < READER_BUFFER_SIZE / 4) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+            if (reader->buffer == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        scanned = reader->end;
+
+        ssize_t bytes_read = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes_read == -1) {
+            perror("read");
+        }
+
+        if (bytes_read <= 0) {
+            reader->eof = 1;
+        }
+
+        else {
+            reader->end += bytes_read;
+        }
+    }
+}
+
+/* run_lines: execute every line reader yields; the input loop for scripts and source. */
+int run_lines(LineReader *reader) {
+    size_t length;
+    char *line;
+
+    while ((line = reader_getline(reader, &length)) != NULL) {
+        reap_jobs(0);
+        execute_line(line);
+    }
+
+    return last_status;
+}
+
+/*
+ * Script cache: with SIMPLE_SHELL_CACHE set to a directory, a script file
+ * that is run or sourced is lexed and parsed once into an image stored
+ * there. The image is named after the script's device and inode and is
+ * checked against the script's size and mtime. Later runs map the image
+ * and go straight to execute_node. Nodes are used in place, and tokens
+ * only need their text pointers fixed up. The map is MAP_PRIVATE, so
+ * dequoting in place never touches the file.
+ * Lines that must be expanded before lexing ($? and $$) or that fail to
+ * parse are stored as text and go through execute_line, so their errors
+ * still appear when the line is reached. Hits, misses and stale images
+ * are counted in a shared "stats" file that --cache-stats prints.
+ *
+ *   header | CacheLine[num_lines] | CacheToken[num_tokens] | Node[num_nodes] | text
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_lines;
+    uint32_t num_tokens;
+    uint32_t num_nodes;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t script_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+} CacheHeader;
+
+typedef struct {
+    uint32_t text_off;
+    uint32_t first_token;
+    uint32_t num_tokens;
+    uint32_t first_node;
+    uint32_t num_nodes;
+    int32_t root;
+} CacheLine;
+
+typedef struct {
+    uint32_t type;
+    uint32_t text_off;
+    uint32_t length;
+    uint32_t quoted;
+} CacheToken;
+
+typedef struct {
+    char *map;
+    size_t size;
+    CacheHeader *header;
+    CacheLine *lines;
+    CacheToken *tokens;
+    Node *nodes;
+    char *text;
+} ScriptImage;
+
+char *cache_path(const char *name) {
+    const char *dir = var_get("SIMPLE_SHELL_CACHE");
+    char *path;
+
+    if (dir == NULL || *dir == '\0' || asprintf(&path, "%s/%s", dir, name) == -1) {
+        return NULL;
+    }
+
+    return path;
+}
+
+char *cache_file_name(const struct stat *st) {
+    char name[64];
+
+    snprintf(name, sizeof(name), "script-%llx-%llx", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return cache_path(name);
+}
+
+/* cache_count: bump one of the CACHE_* counters in the shared stats file. */
+void cache_count(int counter) {
+    char *file_name = cache_path("stats");
+    int fd = file_name != NULL ? open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    uint64_t *stats;
+
+    free(file_name);
+    if (fd == -1) {
+        return;
+    }
+
+    if (ftruncate(fd, CACHE_NUM_COUNTERS * sizeof(uint64_t)) == 0) {
+        stats = mmap(NULL, CACHE_NUM_COUNTERS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (stats != MAP_FAILED) {
+            __atomic_fetch_add(&stats[counter], 1, __ATOMIC_RELAXED);
+            munmap(stats, CACHE_NUM_COUNTERS * sizeof(uint64_t));
+        }
+    }
+
+    close(fd);
+}
+
+int cache_stats(void) {
+    const char *dir_name = var_get("SIMPLE_SHELL_CACHE");
+    char *file_name = cache_path("stats");
+    uint64_t stats[CACHE_NUM_COUNTERS] = {0};
+    unsigned long long entries = 0, bytes = 0;
+
+    if (file_name == NULL) {
+        fprintf(stderr, "--cache-stats: SIMPLE_SHELL_CACHE is not set\n");
+        return 1;
+    }
+
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (read(fd, stats, sizeof(stats)) == -1) {
+            perror("read");
+        }
+        close(fd);
+    }
+    free(file_name);
+
+    DIR *dir = opendir(dir_name);
+    struct dirent *entry;
+    struct stat st;
+
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "script-", 7) == 0 && fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) {
+            entries++;
+            bytes += st.st_size;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    printf("hits: %llu\n", (unsigned long long)stats[CACHE_HITS]);
+    printf("misses: %llu\n", (unsigned long long)stats[CACHE_MISSES]);
+    printf("stale: %llu\n", (unsigned long long)stats[CACHE_STALE]);
+    printf("entries: %llu\n", entries);
+    printf("bytes: %llu\n", bytes);
+    return 0;
+}
+
+/* cache_build: lex and parse every line of text, without running any, and write the image atomically. */
+int cache_build(const char *file_name, const char *text, size_t size, const struct stat *st) {
+    CacheLine *lines = NULL;
+    CacheToken *tokens = NULL;
+    Node *nodes = NULL;
+    size_t num_lines = 0, lines_cap = 0;
+    size_t num_tokens = 0, tokens_cap = 0;
+    size_t num_nodes = 0, nodes_cap = 0;
+    char *copy = malloc(size + 1);
+    int written = 0;
+
+    if (copy == NULL || size >= UINT32_MAX) {
+        free(copy);
+        return 0;
+    }
+
+    memcpy(copy, text, size);
+    copy[size] = '\0';
+    syntax_quiet = 1;
+
+    for (char *line = copy; line < copy + size; ) {
+        char *newline = memchr(line, '\n', copy + size - line);
+        ArenaMark mark = arena_mark(&line_arena);
+        int max_tokens;
+        Token *line_tokens;
+        int count;
+        Ast ast;
+
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        max_tokens = strlen(line) + 1;
+        line_tokens = arena_alloc(&line_arena, max_tokens * sizeof(Token));
+        count = lex_line(line, line_tokens, max_tokens);
+
+        if (num_lines == lines_cap) {
+            lines_cap = lines_cap ? lines_cap * 2 : 256;
+            lines = realloc(lines, lines_cap * sizeof(CacheLine));
+        }
+        if (num_tokens + max_tokens > tokens_cap) {
+            tokens_cap = (num_tokens + max_tokens) * 2;
+            tokens = realloc(tokens, tokens_cap * sizeof(CacheToken));
+        }
+        if (num_nodes + 2 * max_tokens + 2 > nodes_cap) {
+            nodes_cap = (num_nodes + 2 * max_tokens + 2) * 2;
+            nodes = realloc(nodes, nodes_cap * sizeof(Node));
+        }
+        if (lines == NULL || tokens == NULL || nodes == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        CacheLine *record = &lines[num_lines++];
+        record->text_off = line - copy;
+        record->first_token = num_tokens;
+        record->num_tokens = 0;
+        record->first_node = num_nodes;
+        record->num_nodes = 0;
+        record->root = -1;
+
+        if (count == -1) {
+            record->root = CACHE_RELEX;
+        }
+
+        else if (count > 0) {
+            record->root = parse_line(&ast, line_tokens, count);
+
+            if (record->root == -1) {
+                record->root = CACHE_RELEX;
+            }
+
+            else {
+                for (int i = 0; i < count; i++) {
+                    CacheToken *token = &tokens[num_tokens++];
+
+                    token->type = line_tokens[i].type;
+                    token->text_off = line_tokens[i].start - copy;
+                    token->length = line_tokens[i].length;
+                    token->quoted = line_tokens[i].quoted;
+                }
+                memcpy(nodes + num_nodes, ast.nodes, ast.num_nodes * sizeof(Node));
+                num_nodes += ast.num_nodes;
+                record->num_tokens = count;
+                record->num_nodes = ast.num_nodes;
+            }
+        }
+
+        arena_release(&line_arena, mark);
+        line = newline != NULL ? newline + 1 : copy + size;
+    }
+
+    syntax_quiet = 0;
+
+    CacheHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.num_lines = num_lines;
+    header.num_tokens = num_tokens;
+    header.num_nodes = num_nodes;
+    header.dev = st->st_dev;
+    header.ino = st->st_ino;
+    header.script_size = st->st_size;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.size = sizeof(header) + num_lines * sizeof(CacheLine) + num_tokens * sizeof(CacheToken)
+        + num_nodes * sizeof(Node) + size + 1;
+
+    char *tmp_name;
+
+    if (asprintf(&tmp_name, "%s.%d", file_name, getpid()) != -1) {
+        FILE *out = fopen(tmp_name, "w");
+
+        if (out != NULL) {
+            written = fwrite(&header, sizeof(header), 1, out) == 1
+                && fwrite(lines, sizeof(CacheLine), num_lines, out) == num_lines
+                && fwrite(tokens, sizeof(CacheToken), num_tokens, out) == num_tokens
+                && fwrite(nodes, sizeof(Node), num_nodes, out) == num_nodes
+                && fwrite(copy, 1, size + 1, out) == size + 1;
+            written = fclose(out) == 0 && written && rename(tmp_name, file_name) == 0;
+
+            if (!written) {
+                unlink(tmp_name);
+            }
+        }
+
+        free(tmp_name);
+    }
+
+    free(lines);
+    free(tokens);
+    free(nodes);
+    free(copy);
+    return written;
+}
+
+/* cache_valid: the image is for this version of the script and every index in it is in bounds. */
+int cache_valid(ScriptImage *image, const struct stat *st) {
+    CacheHeader *header = image->header;
+
+    if (image->size < sizeof(CacheHeader) || memcmp(header->magic, CACHE_MAGIC, 8) != 0
+        || header->version != CACHE_VERSION || header->size != image->size
+        || header->dev != (uint64_t)st->st_dev || header->ino != (uint64_t)st->st_ino
+        || header->script_size != (uint64_t)st->st_size
+        || header->mtime_sec != st->st_mtim.tv_sec || header->mtime_nsec != st->st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    size_t text_start = sizeof(CacheHeader) + (size_t)header->num_lines * sizeof(CacheLine)
+        + (size_t)header->num_tokens * sizeof(CacheToken) + (size_t)header->num_nodes * sizeof(Node);
+    size_t text_size = image->size - text_start;
+
+    if (text_start >= image->size || image->map[image->size - 1] != '\0') {
+        return 0;
+    }
+
+    image->lines = (CacheLine *)(image->map + sizeof(CacheHeader));
+    image->tokens = (CacheToken *)(image->lines + header->num_lines);
+    image->nodes = (Node *)(image->tokens + header->num_tokens);
+    image->text = image->map + text_start;
+
+    for (uint32_t i = 0; i < header->num_lines; i++) {
+        CacheLine *line = &image->lines[i];
+
+        if (line->text_off >= text_size || line->first_token + (uint64_t)line->num_tokens > header->num_tokens
+            || line->first_node + (uint64_t)line->num_nodes > header->num_nodes
+            || line->root < CACHE_RELEX || line->root >= (int32_t)line->num_nodes) {
+            return 0;
+        }
+
+        for (uint32_t t = 0; t < line->num_tokens; t++) {
+            CacheToken *token = &image->tokens[line->first_token + t];
+
+            if (token->text_off + (uint64_t)token->length >= text_size || token->type > TOKEN_RPAREN) {
+                return 0;
+            }
+        }
+
+        for (uint32_t n = 0; n < line->num_nodes; n++) {
+            Node *node = &image->nodes[line->first_node + n];
+
+            if (node->type < NODE_SIMPLE || node->type > NODE_SUBSHELL
+                || node->child < -1 || node->child >= (int)line->num_nodes
+                || node->next < -1 || node->next >= (int)line->num_nodes
+                || node->first_token < 0 || node->num_tokens < 0
+                || (uint64_t)node->first_token + node->num_tokens > line->num_tokens) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* cache_map: map file_name privately and check it against the script's stat. */
+int cache_map(const char *file_name, const struct stat *script, ScriptImage *image) {
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    image->size = st.st_size;
+    image->map = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->map == MAP_FAILED) {
+        return 0;
+    }
+
+    image->header = (CacheHeader *)image->map;
+    if (!cache_valid(image, script)) {
+        munmap(image->map, image->size);
+        return 0;
+    }
+
+    madvise(image->map, image->size, MADV_SEQUENTIAL);
+    return 1;
+}
+
+/* cache_run: execute a mapped image line by line, like run_lines does for text. */
+int cache_run(ScriptImage *image) {
+    for (uint32_t i = 0; i < image->header->num_lines; i++) {
+        CacheLine *line = &image->lines[i];
+
+        reap_jobs(0);
+
+        if (line->root == CACHE_RELEX) {
+            execute_line(image->text + line->text_off);
+        }
+
+        else if (line->root != -1) {
+            ArenaMark mark = arena_mark(&line_arena);
+            Token *tokens = arena_alloc(&line_arena, line->num_tokens * sizeof(Token));
+            Ast ast = {0};
+
+            for (uint32_t t = 0; t < line->num_tokens; t++) {
+                CacheToken *token = &image->tokens[line->first_token + t];
+
+                tokens[t].type = token->type;
+                tokens[t].start = image->text + token->text_off;
+                tokens[t].length = token->length;
+                tokens[t].quoted = token->quoted;
+            }
+
+            /* Aliases are only known at run time: a line that uses one is parsed again. */
+            Token *expanded = tokens;
+            int num_tokens = expand_aliases(&expanded, line->num_tokens);
+
+            if (num_tokens == -1) {
+                last_status = 2;
+            }
+
+            else if (expanded == tokens) {
+                ast.tokens = tokens;
+                ast.num_tokens = line->num_tokens;
+                ast.nodes = image->nodes + line->first_node;
+                ast.num_nodes = line->num_nodes;
+
+                last_status = execute_node(&ast, line->root);
+            }
+
+            else {
+                int root = parse_line(&ast, expanded, num_tokens);
+
+                last_status = root == -1 ? 2 : execute_node(&ast, root);
+            }
+            finish_line(mark);
+        }
+    }
+
+    return last_status;
+}
+
+/*
+ * run_file: run the script open on fd, from its cached image when there is
+ * a valid one, otherwise from text (refreshing the cache on the way).
+ */
+int run_file(int fd) {
+    LineReader reader;
+    struct stat st;
+    char *file_name = NULL;
+    int status;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        file_name = cache_file_name(&st);
+    }
+
+    if (file_name != NULL) {
+        ScriptImage image;
+        int mapped = cache_map(file_name, &st, &image);
+
+        if (mapped == 1) {
+            cache_count(CACHE_HITS);
+            free(file_name);
+            status = cache_run(&image);
+            munmap(image.map, image.size);
+            return status;
+        }
+
+        cache_count(CACHE_MISSES);
+        if (mapped == 0) {
+            cache_count(CACHE_STALE);
+        }
+    }
+
+    reader_open(&reader, fd);
+    if (file_name != NULL && reader.mapped != 0) {
+        cache_build(file_name, reader.buffer, reader.end, &st);
+    }
+    free(file_name);
+
+    status = run_lines(&reader);
+    reader_free(&reader);
+    return status;
+}
+
+/* source FILE, . FILE: run the lines of FILE in the current shell. */
+int builtin_source(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Usage: %s FILE\n", args[0]);
+        return 2;
+    }
+
+    int fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s: %s\n", args[0], args[1], strerror(errno));
+        return 1;
+    }
+
+    last_status = 0;
+    int status = run_file(fd);
+    close(fd);
+
+    return status;
+}
+
+void execute_commands_from_file(const char *filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    run_file(fd);
+    close(fd);
+
+    alias_clear();
+    printf("Exiting simple_shell.\n");
+}
+
+/* bench_scan.c includes this file for its functions and brings its own main. */
+#ifndef SIMPLE_SHELL_NO_MAIN
+/*
+ * run_string: run the lines of a -c string. The lexer does not split on
+ * newlines, so each line goes to execute_line on its own.
+ */
+int run_string(char *text) {
+    for (char *line = text; line != NULL; ) {
+        char *newline = strchr(line, '\n');
+
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        execute_line(line);
+        line = newline != NULL ? newline + 1 : NULL;
+    }
+
+    return last_status;
+}
+
+/*
+ * simple_shell [-is] [-c string [name] | file] [args]. Without a file or -c, commands come
+ * from stdin, with a prompt only when interactive: stdin is a terminal or
+ * -i was given. Otherwise there is no prompt, no cwd lookup per line and stdout
+ * is fully buffered, flushed only before a child is started and at exit.
+ */
+int main(int argc, char *argv[]) {
+    char *command_string = NULL;
+    char *script = NULL;
+    int force_interactive = 0;
+    int read_stdin = 0;
+    int command_mode = 0;
+    int i = 1;
+
+    var_init();
+    if (argc == 2 && strcmp(argv[1], "--cache-stats") == 0) {
+        return cache_stats();
+    }
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+
+        for (char *flag = argv[i] + 1; *flag != '\0'; flag++) {
+            if (*flag == 'i') {
+                force_interactive = 1;
+            }
+
+            else if (*flag == 's') {
+                read_stdin = 1;
+            }
+
+            else if (*flag == 'c') {
+                command_mode = 1;
+            }
+
+            else {
+                fprintf(stderr, "Usage: %s [-is] [-c string [name] | filename] [args...] | --cache-stats\n", argv[0]);
+                return 2;
+            }
+        }
+    }
+
+    if (command_mode) {
+        if (i == argc) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            return 2;
+        }
+        command_string = argv[i++];
+    }
+
+    /* $0 and the positional parameters: the script or -c name, then the rest. */
+    shell_pid = getpid();
+    shell_name = argv[0];
+    if (command_string != NULL && i < argc) {
+        shell_name = argv[i++];
+    }
+
+    else if (command_string == NULL && !read_stdin && i < argc) {
+        script = shell_name = argv[i++];
+    }
+    positional = argv + i;
+    num_positional = argc - i;
+
+    interactive = command_string == NULL && script == NULL && (force_interactive || isatty(STDIN_FILENO));
+    if (!interactive) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
+    zygote_start();
+    jobs_init();
+    arena_debug = getenv("SIMPLE_SHELL_ARENA_DEBUG") != NULL;
+
+    if (command_string != NULL) {
+        run_string(command_string);
+        fflush(stdout);
+        return last_status;
+    }
+
+    else if (script != NULL) {
+        execute_commands_from_file(script);
+    } 
+    
+    else {
+        LineReader reader;
+        size_t length;
+
+        reader_init(&reader, STDIN_FILENO);
+
+        while (1) {
+            reap_jobs(interactive);
+
+            if (interactive) {
+                const char *cwd = pwd_get();
+
+                printf("simple_shell:%s$ ", cwd != NULL ? cwd : "?");
+                fflush(stdout);
+            }
+
+            char *input = reader_getline(&reader, &length);
+            if (input == NULL) {
+                if (interactive) {
+                    printf("\n");
+                }
+                break;
+            }
+
+            execute_line(input);
+        }
+
+        reader_free(&reader);
+
+        alias_clear();
+        printf("Exiting simple_shell.\n");
+    }
+
+    return last_status;
+}
+#endif
@@ -130,15 +130,22 @@ void print_aliases(char **args) {
 int main(void) {
     char input[MAX_INPUT_LENGTH];
     char cwd[PATH_MAX]; 
+    int interactive = isatty(STDIN_FILENO);
     while (1) {
-        if (getcwd(cwd, sizeof(cwd)) == NULL) {
-            perror("getcwd");
-            exit(EXIT_FAILURE);
+        /* Piped input gets no prompt, so no getcwd either. */
+        if (interactive) {
+            if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                perror("getcwd");
+                exit(EXIT_FAILURE);
+            }
+
+            printf("simple_shell:%s$ ", cwd); 
         }
 
-        printf("simple_shell:%s$ ", cwd); 
         if (fgets(input, sizeof(input), stdin) == NULL) {
-            printf("\n");
+            if (interactive) {
+                printf("\n");
+            }
             break;
         }
 